@@ -0,0 +1,248 @@
+// Times the audio mixer (using an offline Audio, so no device is needed) and the conversion of
+// sounds to the output sample rate. Build and run with "make benchmarks" then
+// "./Benchmarks/AudioBenchmark.out".
+#include "MediaInterface/Audio/Audio.h"
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+using mi::Audio;
+using mi::AudioSettings;
+using mi::SampleStorage;
+using mi::SoundChannelHandle;
+using mi::SoundEndRule;
+using mi::SoundHandle;
+using mi::WavHelper;
+using std::uint32_t;
+using std::uint64_t;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+// Count every allocation, the callback shouldn't make any once the channels are playing. The
+// malloc() and free() calls are kept out of line so the compiler doesn't pair free() with a
+// new-expression it can see (which it warns about).
+static std::atomic<uint64_t> allocations{0};
+
+__attribute__((noinline)) static void* Allocate(std::size_t size)
+{
+    allocations++;
+    return std::malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) static void Deallocate(void* p) noexcept
+{
+    std::free(p);
+    return;
+}
+
+void* operator new(std::size_t size)
+{
+    if (void* p = Allocate(size))
+        return p;
+
+    throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+    Deallocate(p);
+    return;
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    Deallocate(p);
+    return;
+}
+
+void operator delete[](void* p) noexcept
+{
+    Deallocate(p);
+    return;
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+    Deallocate(p);
+    return;
+}
+
+namespace
+{
+
+const uint32_t callbackFrames = 1024; // Frames per Render(), i.e. per callback.
+const uint32_t numCallbacks   = 200;
+
+class Format
+{
+public:
+    std::uint16_t format;
+    const char*   name;
+};
+
+const Format formats[] =
+{
+    {AUDIO_U8,     "U8"},
+    {AUDIO_S8,     "S8"},
+    {AUDIO_U16LSB, "U16LSB"},
+    {AUDIO_U16MSB, "U16MSB"},
+    {AUDIO_S16LSB, "S16LSB"},
+    {AUDIO_S16MSB, "S16MSB"},
+    {AUDIO_S32LSB, "S32LSB"},
+    {AUDIO_S32MSB, "S32MSB"},
+    {AUDIO_F32LSB, "F32LSB"},
+    {AUDIO_F32MSB, "F32MSB"}
+};
+
+// A second of a stereo tone, with a different pitch on each side.
+WavHelper MakeTone(unsigned long sampleRate)
+{
+    WavHelper wavHelper;
+    wavHelper.sampleRate = sampleRate;
+    wavHelper.amplitudes.assign(2, vector<std::int16_t>(sampleRate));
+
+    for (unsigned long n=0; n<sampleRate; n++)
+    {
+        double t = static_cast<double>(n)/sampleRate;
+        wavHelper.amplitudes[0][n] = static_cast<std::int16_t>(20000*std::sin(2*3.14159*440*t));
+        wavHelper.amplitudes[1][n] = static_cast<std::int16_t>(20000*std::sin(2*3.14159*660*t));
+    }
+
+    return wavHelper;
+}
+
+double SecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+}
+
+void PrintResult(const string& name, double seconds, uint64_t numSamples, uint64_t numAllocations,
+                 uint64_t numCalls)
+{
+    cout << std::left << std::setw(36) << name << std::right << std::fixed
+         << std::setprecision(2) << std::setw(10) << 1e9*seconds/numSamples << " ns/sample"
+         << std::setprecision(2) << std::setw(10)
+         << static_cast<double>(numAllocations)/numCalls << " allocs/call" << endl;
+    return;
+}
+
+// Mixes numChannels looping channels (staggered so they don't line up) for numCallbacks.
+void BenchmarkMixer(uint32_t numChannels, const Format& format, SampleStorage storage)
+{
+    AudioSettings settings;
+    settings.offline       = true;
+    settings.offlineFormat = format.format;
+    settings.maxVoices     = 0;
+
+    Audio audio;
+    audio.Init(settings);
+
+    SoundHandle sound = audio.CreateSound(MakeTone(44100), storage);
+    vector<SoundChannelHandle> channels;
+
+    for (uint32_t n=0; n<numChannels; n++)
+    {
+        channels.push_back(audio.CreateSoundChannel());
+        channels.back().LoadAndPlay(sound, SoundEndRule::Loop, 1.0/numChannels, n*97%44100);
+    }
+
+    vector<std::uint8_t> output(callbackFrames*audio.GetFrameBytes());
+
+    // Warm up, so the buffers and caches are in their steady state.
+    for (uint32_t n=0; n<10; n++)
+        audio.Render(output.data(), callbackFrames);
+
+    uint64_t startAllocations = allocations;
+    auto     start            = std::chrono::steady_clock::now();
+
+    for (uint32_t n=0; n<numCallbacks; n++)
+        audio.Render(output.data(), callbackFrames);
+
+    double   seconds        = SecondsSince(start);
+    uint64_t numAllocations = allocations-startAllocations;
+
+    const char* storageNames[] = {"Float", "Int16", "Adpcm"};
+    string name = "Mix " + std::to_string(numChannels) + " channels " + format.name + " "
+                  + storageNames[static_cast<int>(storage)];
+
+    // The offline output is stereo.
+    PrintResult(name, seconds, static_cast<uint64_t>(numCallbacks)*callbackFrames*2,
+                numAllocations, numCallbacks);
+    return;
+}
+
+// Times creating a sound (converting it to the output sample rate).
+void BenchmarkConvert(unsigned long fromRate, long toRate)
+{
+    AudioSettings settings;
+    settings.offline    = true;
+    settings.sampleRate = toRate;
+
+    Audio audio;
+    audio.Init(settings);
+
+    WavHelper wavHelper = MakeTone(fromRate);
+    const uint32_t numSounds = 10;
+
+    uint64_t startAllocations = allocations;
+    auto     start            = std::chrono::steady_clock::now();
+
+    for (uint32_t n=0; n<numSounds; n++)
+        audio.CreateSound(wavHelper);
+
+    double   seconds        = SecondsSince(start);
+    uint64_t numAllocations = allocations-startAllocations;
+
+    // Each sound is a second long, so there are 2*toRate output samples.
+    PrintResult("Convert " + std::to_string(fromRate) + " to " + std::to_string(toRate),
+                seconds, static_cast<uint64_t>(numSounds)*2*toRate, numAllocations, numSounds);
+    return;
+}
+
+} // End of anonymous namespace.
+
+int main()
+{
+    try
+    {
+        cout << "Mixing (" << callbackFrames << " frames per call)" << endl;
+
+        for (uint32_t numChannels : {1, 8, 64, 512})
+        {
+            for (const Format& format : formats)
+                BenchmarkMixer(numChannels, format, SampleStorage::Float);
+        }
+
+        for (SampleStorage storage : {SampleStorage::Int16, SampleStorage::Adpcm})
+            BenchmarkMixer(64, formats[4], storage);
+
+        cout << endl << "Converting (per sound)" << endl;
+
+        const unsigned long rates[][2] =
+            {{44100, 44100}, {22050, 44100}, {44100, 48000}, {48000, 44100}, {11025, 48000}};
+
+        for (auto& rate : rates)
+            BenchmarkConvert(rate[0], static_cast<long>(rate[1]));
+    }
+    catch (const std::exception& e)
+    {
+        cout << "Error: " << e.what() << endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,146 @@
+// Times drawing sprites (textured rectangles) on to an image, separately timing the recording of
+// the vertices by DrawTexture() and sending them to the GPU. Needs a display for the (hidden)
+// OpenGL window. Build and run with "make benchmarks" then "./Benchmarks/SpriteBenchmark.out".
+#include "MediaInterface/Graphics/Graphics.h"
+#include <SDL.h>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using error = std::runtime_error;
+using mi::Color;
+using mi::Graphics;
+using std::uint32_t;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+namespace
+{
+
+const uint32_t targetWidth  = 1920;
+const uint32_t targetHeight = 1080;
+const uint32_t spriteSize   = 32;
+const uint32_t numFrames    = 20;
+
+double SecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+}
+
+// Draws numSprites per frame, cycling through the source textures.
+void BenchmarkSprites(Graphics& graphics, uint32_t target, const vector<uint32_t>& sources,
+                      uint32_t numSprites)
+{
+    double recordSeconds = 0;
+    double submitSeconds = 0;
+
+    for (uint32_t frame=0; frame<numFrames+1; frame++)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        for (uint32_t n=0; n<numSprites; n++)
+        {
+            float x = static_cast<float>((n*37)%(targetWidth-spriteSize));
+            float y = static_cast<float>((n*91)%(targetHeight-spriteSize));
+
+            graphics.DrawTexture(target, x, y, spriteSize, spriteSize,
+                                 sources[n%sources.size()], 0, 0, spriteSize, spriteSize, 255,
+                                 0, 0, 0, 0, 0,
+                                 0, 0, 0, 0);
+        }
+
+        double recorded = SecondsSince(start);
+
+        graphics.FlushRenderData();
+        glFinish();
+
+        // The first frame is a warm up (so the buffers have grown to their steady state).
+        if (frame != 0)
+        {
+            recordSeconds += recorded;
+            submitSeconds += SecondsSince(start)-recorded;
+        }
+    }
+
+    double numDrawn = static_cast<double>(numSprites)*numFrames;
+    string name = std::to_string(numSprites) + " sprites, " + std::to_string(sources.size())
+                  + " textures";
+
+    cout << std::left << std::setw(28) << name << std::right << std::fixed
+         << std::setprecision(2)
+         << std::setw(8) << numDrawn/recordSeconds/1e6 << " M/s recording"
+         << std::setw(8) << numDrawn/(recordSeconds+submitSeconds)/1e6 << " M/s total" << endl;
+    return;
+}
+
+} // End of anonymous namespace.
+
+int main(int, char**)
+{
+    SDL_Window*   window    = nullptr;
+    SDL_GLContext glContext = nullptr;
+    int           result    = 0;
+
+    try
+    {
+        if (SDL_Init(SDL_INIT_VIDEO) < 0)
+            throw error(string("SDL initialization failed: ")+SDL_GetError());
+
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
+        SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK,  SDL_GL_CONTEXT_PROFILE_CORE);
+
+        window = SDL_CreateWindow("Sprite Benchmark",
+                                  SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 100, 100,
+                                  SDL_WINDOW_OPENGL | SDL_WINDOW_HIDDEN);
+        if (!window)
+            throw error(string("SDL window creation failed: ")+SDL_GetError());
+
+        glContext = SDL_GL_CreateContext(window);
+        if (!glContext)
+            throw error(string("Creating OpenGL context failed: ")+SDL_GetError());
+
+        Graphics graphics;
+        graphics.Init(100, 100);
+
+        uint32_t target = graphics.CreateTexture(targetWidth, targetHeight, nullptr, false);
+        vector<uint32_t> sources;
+
+        for (uint32_t n=0; n<8; n++)
+        {
+            sources.push_back(graphics.CreateTexture(spriteSize, spriteSize, nullptr, false));
+            graphics.ClearTexture(sources.back(), Color(255, 32*n, 0));
+        }
+
+        cout << "Drawing " << spriteSize << "x" << spriteSize << " sprites on "
+             << targetWidth << "x" << targetHeight << " (" << numFrames << " frames)" << endl;
+
+        for (uint32_t numSprites : {1000, 10000, 100000})
+        {
+            BenchmarkSprites(graphics, target, vector<uint32_t>(1, sources[0]), numSprites);
+            BenchmarkSprites(graphics, target, sources, numSprites);
+        }
+
+        graphics.Free();
+    }
+    catch (const std::exception& e)
+    {
+        cout << "Error: " << e.what() << endl;
+        result = 1;
+    }
+
+    if (glContext)
+        SDL_GL_DeleteContext(glContext);
+
+    if (window)
+        SDL_DestroyWindow(window);
+
+    SDL_Quit();
+    return result;
+}
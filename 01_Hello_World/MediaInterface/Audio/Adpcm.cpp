@@ -0,0 +1,144 @@
+#include "Adpcm.h"
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+using std::uint8_t;
+using std::int16_t;
+using std::int32_t;
+using std::size_t;
+
+namespace
+{
+
+const int32_t stepTable[89] =
+{
+        7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+       19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+       50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+      130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+      337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+      876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+     2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+     5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+const int32_t indexTable[16] =
+{
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+// Updates the predictor and step index with a code, returning the new predictor.
+inline int32_t DecodeNibble(uint8_t code, int32_t predictor, int32_t& stepIndex)
+{
+    int32_t step = stepTable[stepIndex];
+    int32_t diff = step >> 3;
+
+    if (code & 4) diff += step;
+    if (code & 2) diff += step >> 1;
+    if (code & 1) diff += step >> 2;
+
+    if (code & 8)
+        predictor -= diff;
+    else
+        predictor += diff;
+
+    stepIndex = std::clamp(stepIndex+indexTable[code], 0, 88);
+    return std::clamp(predictor, -32768, 32767);
+}
+
+// Picks the code that best matches the sample (as the decoder will see it).
+inline uint8_t EncodeNibble(int32_t sample, int32_t predictor, int32_t stepIndex)
+{
+    int32_t step = stepTable[stepIndex];
+    int32_t diff = sample-predictor;
+    uint8_t code = 0;
+
+    if (diff < 0)
+    {
+        code = 8;
+        diff = -diff;
+    }
+
+    if (diff >= step)
+    {
+        code |= 4;
+        diff -= step;
+    }
+
+    if (diff >= step >> 1)
+    {
+        code |= 2;
+        diff -= step >> 1;
+    }
+
+    if (diff >= step >> 2)
+        code |= 1;
+
+    return code;
+}
+
+} // End of anonymous namespace.
+
+namespace mi
+{
+
+void Adpcm::Encode(const int16_t* samples, size_t numFrames, std::vector<uint8_t>& output)
+{
+    size_t numBlocks = (numFrames+blockFrames-1)/blockFrames;
+    output.assign(numBlocks*blockBytes, 0);
+
+    // The step index carries on between blocks, so each block starts well adapted.
+    int32_t stepIndex = 0;
+
+    for (size_t b=0; b<numBlocks; b++)
+    {
+        uint8_t* block = output.data()+b*blockBytes;
+        size_t   first = b*blockFrames;
+
+        auto sample = [&](size_t n) -> int32_t
+            { return samples[std::min(first+n, numFrames-1)]; };
+
+        int32_t predictor = sample(0);
+        block[0] = static_cast<uint8_t>(predictor & 0xFF);
+        block[1] = static_cast<uint8_t>((predictor >> 8) & 0xFF);
+        block[2] = static_cast<uint8_t>(stepIndex);
+        block[3] = 0;
+
+        for (uint32_t n=1; n<blockFrames; n++)
+        {
+            uint8_t code = EncodeNibble(sample(n), predictor, stepIndex);
+            predictor = DecodeNibble(code, predictor, stepIndex);
+
+            uint8_t& byte = block[4+(n-1)/2];
+            byte |= ((n-1) & 1) ? static_cast<uint8_t>(code << 4) : code;
+        }
+    }
+
+    return;
+}
+
+void Adpcm::DecodeBlock(const uint8_t* block, int16_t* output)
+{
+    int32_t predictor = static_cast<int16_t>(block[0] | (block[1] << 8));
+    int32_t stepIndex = std::min<int32_t>(block[2], 88);
+
+    output[0] = static_cast<int16_t>(predictor);
+
+    const uint8_t* codes = block+4;
+    for (uint32_t n=1; n<blockFrames; n++)
+    {
+        uint8_t byte = codes[(n-1)/2];
+        uint8_t code = ((n-1) & 1) ? (byte >> 4) : (byte & 0x0F);
+
+        predictor = DecodeNibble(code, predictor, stepIndex);
+        output[n] = static_cast<int16_t>(predictor);
+    }
+
+    return;
+}
+
+} // End of namespace mi.
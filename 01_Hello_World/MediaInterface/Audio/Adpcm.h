@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace mi
+{
+
+// IMA ADPCM encoding of 16 bit samples (4 bits per sample).
+// The samples are split into independent blocks so any part of a sound can be decoded without
+// decoding what comes before it. Each block starts with the first sample and the step index,
+// followed by the codes of the remaining samples packed two per byte.
+class Adpcm
+{
+public:
+    static const std::uint32_t blockFrames = 128;
+    static const std::uint32_t blockBytes  = 4+(blockFrames-1+1)/2;
+
+    // The output is resized to hold the blocks, the last block is padded with the last sample.
+    static void Encode(const std::int16_t* samples, std::size_t numFrames,
+                       std::vector<std::uint8_t>& output);
+
+    // Decodes blockFrames samples.
+    static void DecodeBlock(const std::uint8_t* block, std::int16_t* output);
+};
+
+} // End of namespace mi.
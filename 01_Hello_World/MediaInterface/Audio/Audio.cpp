@@ -6,15 +6,22 @@
 #include <cstdint>
 #include <vector>
 #include <deque>
-#include <functional>
 #include <mutex>
 #include <iostream>
 #include <utility>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
 
 using error = std::runtime_error;
 using std::string;
 using std::uint8_t;
 using std::uint32_t;
+using std::uint64_t;
 using std::vector;
 using std::deque;
 using std::mutex;
@@ -46,13 +53,101 @@ static void DisplayAudioSpec(string title, const SDL_AudioSpec& spec)
 }
 */
 
+namespace
+{
+
+// Adds gain*input to the output, where the gain changes by step each frame. The loop is simple
+// enough to be vectorized by the compiler (including the conversion of the input samples to float).
+template<typename T>
+void MixSamples(const T* __restrict inLeft, const T* __restrict inRight,
+                float gainLeft, float stepLeft, float gainRight, float stepRight,
+                float* __restrict outLeft, float* __restrict outRight, uint32_t count)
+{
+    for (uint32_t n=0; n<count; n++)
+    {
+        float f = static_cast<float>(n);
+        outLeft[n]  += (gainLeft+stepLeft*f)*inLeft[n];
+        outRight[n] += (gainRight+stepRight*f)*inRight[n];
+    }
+    return;
+}
+
+// FNV-1a hash of the sound data, used to identify sounds in the caches.
+std::uint64_t HashWav(const mi::WavHelper& wavHelper)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+
+    auto add = [&hash](const void* data, std::size_t size)
+    {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (std::size_t i=0; i<size; i++)
+            hash = (hash^bytes[i])*1099511628211ull;
+    };
+
+    add(&wavHelper.sampleRate, sizeof(wavHelper.sampleRate));
+    for (const auto& channel : wavHelper.amplitudes)
+    {
+        std::uint64_t size = channel.size();
+        add(&size, sizeof(size));
+        add(channel.data(), channel.size()*sizeof(std::int16_t));
+    }
+
+    return hash;
+}
+
+float Clamp(float input)
+{
+    return std::min(std::max(input, -1.0f), 1.0f);
+}
+
+// Conversion routines from [-1, 1] to 8/16/32 bit Signed/Unsigned Float/Integer.
+template<typename T> T FromFloat(float input);
+
+template<> std::uint8_t  FromFloat(float input)
+    { return static_cast<std::uint8_t>((input+1)/2 * 255); }
+template<> std::int8_t   FromFloat(float input)
+    { return static_cast<std::int8_t>(input*127); }
+template<> std::uint16_t FromFloat(float input)
+    { return static_cast<std::uint16_t>((input+1)/2 * 65535); }
+template<> std::int16_t  FromFloat(float input)
+    { return static_cast<std::int16_t>(input*32767); }
+// 32 bit integers need the precision of a double.
+template<> std::uint32_t FromFloat(float input)
+    { return static_cast<std::uint32_t>((static_cast<double>(input)+1)/2 * 4294967295); }
+template<> std::int32_t  FromFloat(float input)
+    { return static_cast<std::int32_t>(static_cast<double>(input)*2147483647); }
+template<> float         FromFloat(float input)
+    { return input; }
+
+// Writes the sample in System (or Not System if swapBytes is set) endian.
+template<typename T, bool swapBytes>
+void StoreSample(float input, uint8_t* buffer)
+{
+    T z = FromFloat<T>(input);
+    uint8_t pBytes[sizeof(T)];
+    std::memcpy(pBytes, &z, sizeof(T));
+
+    for (std::size_t i=0; i<sizeof(T); i++)
+        buffer[i] = pBytes[swapBytes ? sizeof(T)-1-i : i];
+
+    return;
+}
+
+} // End of anonymous namespace.
+
 namespace mi
 {
 
 Audio::Audio()
 {
     initialized    = false;
+    offline        = false;
     callbackIsGood = false;
+    clock          = 0;
+    maxVoices      = 0;
+    voiceStealing  = VoiceStealing::Oldest;
+    cacheSounds    = false;
+    callbackMicrosecondsTotal = 0;
     return;
 }
 
@@ -70,127 +165,650 @@ void Audio::CallbackWrapper(void* userData, uint8_t* stream, int length)
 
 void Audio::Callback(uint8_t* stream, uint32_t length)
 {
+    // Start timing before taking the mutex, so waiting for it counts.
+    auto start = std::chrono::steady_clock::now();
     lock_guard<mutex> lock(audioMutex);
 
     if (!callbackIsGood)
     {
-        // Fill with silence.
-        while (length > 0)
-            ConvertDouble(0, stream, length);
+        OutputSilence(stream, length);
         return;
     }
 
     try
     {
-        vector<uint32_t> playing;
-        for (auto& it : channels)
-        {
-            if (it.second && it.second->soundState==SoundState::Playing && it.second->soundId!=0)
-                playing.push_back(it.first);
-        }
+        CollectGarbage();
+        FindPlaying(playing, nullptr);
+
+        deleteList.clear();
 
         uint8_t* buf = stream;
-        vector<uint32_t> deleteList;
-        Channel* pC;
+        uint32_t frameBytes = static_cast<uint32_t>(bytesPerSample*numChannels);
+        Bus&     master     = buses[static_cast<std::size_t>(AudioBus::Master)];
+
+        if (maxVoices != 0)
+            StealVoices(clock+length/frameBytes);
+
+        voices.clear();
+        for (uint32_t channelId : playing)
+        {
+            Channel* pC = channels[channelId].get();
+            voices.push_back({channelId, pC, sounds[pC->soundId].get()});
+        }
 
         while (length > 0)
         {
-            for (long c=0; c<numChannels; c++)
+            // Mix a block of frames at a time.
+            uint32_t numFrames = std::min(length/frameBytes, static_cast<uint32_t>(mixLeft.size()));
+
+            if (numFrames == 0)
             {
-                if (c >= 2)
-                {
-                    ConvertDouble(0, buf, length);
+                // Not enough room for a whole frame.
+                std::memset(buf, 0, length);
+                break;
+            }
+
+            std::fill(mixLeft.begin(),  mixLeft.begin()+numFrames,  0.0f);
+            std::fill(mixRight.begin(), mixRight.begin()+numFrames, 0.0f);
+
+            // The prerender worker owns the blocks of prerendered buses.
+            for (std::size_t n=0; n<numBuses; n++)
+            {
+                if (!buses[n].prerender)
+                    buses[n].used = false;
+            }
+
+            MixChannels(voices, clock, numFrames, callbackMix);
+
+            for (std::size_t n=0; n<numBuses; n++)
+            {
+                if (&buses[n] == &master)
                     continue;
-                }
 
-                double result = 0;
+                if (buses[n].prerender)
+                    MixPrerenderedBus(buses[n], numFrames);
+                else
+                    MixBus(buses[n], numFrames);
+            }
 
-                for (uint32_t channelId : playing)
-                {
-                    pC = channels[channelId].get();
+            // The Master bus is mixLeft and mixRight.
+            for (auto& pEffect : master.effects)
+                pEffect->Process(mixLeft.data(), mixRight.data(), numFrames, sampleRate);
 
-                    if (pC->soundState == SoundState::Stopped)
-                        continue;
+            if (master.gain != 1 || master.currentGain != 1)
+            {
+                float gain = master.currentGain;
+                float step = (static_cast<float>(master.gain)-gain)/numFrames;
 
-                    Sound* pS = sounds[pC->soundId].get();
-
-                    if (pC->sampleIndex >= pS->left.size())
-                    {
-                        // Reached the end of the sound.
-                        if (pC->soundEndRule == SoundEndRule::Loop)
-                            pC->sampleIndex = 0;
-                        else
-                        {
-                            if (pC->soundEndRule == SoundEndRule::StopAndDeleteChannel)
-                                deleteList.push_back(channelId);
-
-                            pC->soundState = SoundState::Stopped;
-                            continue;
-                        }
-                    }
-
-                    if (c == 0)
-                        result += pC->volume * pS->left[pC->sampleIndex];
-
-                    if (c == 1 || numChannels == 1)
-                    {
-                        result += pC->volume * pS->right[pC->sampleIndex];
-                        pC->sampleIndex++;
-                    }
+                for (uint32_t n=0; n<numFrames; n++)
+                {
+                    mixLeft[n]  *= gain+step*n;
+                    mixRight[n] *= gain+step*n;
                 }
 
-                if (numChannels == 1)
-                    result /= 2;
+                master.currentGain = static_cast<float>(master.gain);
+            }
+
+            ConvertBlock(mixLeft.data(), mixRight.data(), numChannels, numFrames, buf);
+            buf    += numFrames*frameBytes;
+            length -= numFrames*frameBytes;
+            clock  += numFrames;
+        }
+
+        deleteList.insert(deleteList.end(), callbackMix.finished.begin(),
+                          callbackMix.finished.end());
+        callbackMix.finished.clear();
+        stats.streamUnderrunFrames += callbackMix.streamUnderrunFrames;
+        callbackMix.streamUnderrunFrames = 0;
+
+        DeleteChannels();
+    }
+    catch(...)
+    {
+        // We can't let exceptions escape, as this function is being called in a thread.
+        callbackIsGood = false;
+    }
 
-                if (result < -1)
-                    result = -1;
-                if (result > 1)
-                    result = 1;
+    // Update the timing stats.
+    double duration = std::chrono::duration<double, std::micro>(
+        std::chrono::steady_clock::now()-start).count();
 
-                ConvertDouble(result, buf, length);
+    stats.callbacks++;
+    stats.lastCallbackMicroseconds = duration;
+    stats.maxCallbackMicroseconds  = std::max(stats.maxCallbackMicroseconds, duration);
+    callbackMicrosecondsTotal     += duration;
+    stats.meanCallbackMicroseconds = callbackMicrosecondsTotal/stats.callbacks;
+
+    if (duration > stats.budgetMicroseconds)
+        stats.overBudgetCallbacks++;
+
+    return;
+}
+
+void Audio::StealVoices(uint64_t callbackEnd)
+{
+    // Move the channels playing during this callback to the front, including those scheduled to
+    // start in it. Ones scheduled later aren't counted until then.
+    auto scheduled = std::partition(playing.begin(), playing.end(), [this, callbackEnd](uint32_t id)
+        {
+            const Channel* pC = channels[id].get();
+            return pC->soundState == SoundState::Playing || pC->startTime < callbackEnd;
+        });
+
+    uint32_t numPlaying = static_cast<uint32_t>(scheduled-playing.begin());
+    if (numPlaying <= maxVoices)
+        return;
+
+    // Order the playing channels so those to be stopped come first (channels yet to start count
+    // as the most recently started).
+    auto first = [this](uint32_t lhs, uint32_t rhs)
+    {
+        const Channel* pL = channels[lhs].get();
+        const Channel* pR = channels[rhs].get();
+
+        if (pL->priority != pR->priority)
+            return pL->priority < pR->priority;
+
+        if (voiceStealing == VoiceStealing::Quietest && pL->volume != pR->volume)
+            return pL->volume < pR->volume;
+
+        uint64_t lhsTime = (pL->soundState == SoundState::Playing) ? pL->playTime : pL->startTime;
+        uint64_t rhsTime = (pR->soundState == SoundState::Playing) ? pR->playTime : pR->startTime;
+        return lhsTime < rhsTime;
+    };
+
+    uint32_t numStolen = numPlaying-maxVoices;
+    std::nth_element(playing.begin(), playing.begin()+numStolen, scheduled, first);
+
+    for (uint32_t n=0; n<numStolen; n++)
+    {
+        Channel* pC = channels[playing[n]].get();
+
+        pC->soundState  = SoundState::Stopped;
+        pC->sampleIndex = 0;
+        pC->startTime   = noTime;
+        pC->stopTime    = noTime;
+
+        if (pC->soundEndRule == SoundEndRule::StopAndDeleteChannel)
+            deleteList.push_back(playing[n]);
+    }
+
+    playing.erase(playing.begin(), playing.begin()+numStolen);
+    stats.voicesStolen += numStolen;
+
+    return;
+}
+
+void Audio::FindPlaying(vector<uint32_t>& list, const Bus* pBus)
+{
+    list.clear();
+
+    for (auto& it : channels)
+    {
+        const Channel* pC = it.second.get();
+
+        if (!pC || pC->soundId==0 || pC->prerendering ||
+            (pC->soundState!=SoundState::Playing && pC->startTime==noTime))
+            continue;
+
+        const Bus* pChannelBus = &buses[static_cast<std::size_t>(pC->bus)];
+
+        if (pBus ? pChannelBus==pBus : !pChannelBus->prerender)
+            list.push_back(it.first);
+    }
+
+    return;
+}
+
+void Audio::MixChannels(const vector<Voice>& voices, uint64_t blockClock, uint32_t numFrames,
+                        MixState& mix)
+{
+    uint64_t blockEnd = blockClock+numFrames;
+
+    for (const Voice& voice : voices)
+    {
+        ChannelState* pC = voice.pChannel;
+        uint32_t begin = 0;
+        uint32_t end   = numFrames;
+
+        if (pC->soundState != SoundState::Playing && pC->startTime >= blockEnd)
+            continue;
+
+        bool     stop      = pC->stopTime < blockEnd;
+        uint32_t stopFrame = stop ? static_cast<uint32_t>(std::max(pC->stopTime, blockClock)
+                                                          -blockClock)
+                                  : numFrames;
+
+        // Channels on the Master bus are mixed straight into the output.
+        float* left  = mixLeft.data();
+        float* right = mixRight.data();
+
+        if (pC->bus != AudioBus::Master)
+        {
+            Bus& bus = buses[static_cast<std::size_t>(pC->bus)];
+
+            if (!bus.used)
+            {
+                std::fill(bus.left.begin(),  bus.left.begin()+numFrames,  0.0f);
+                std::fill(bus.right.begin(), bus.right.begin()+numFrames, 0.0f);
+                bus.used = true;
             }
+
+            left  = bus.left.data();
+            right = bus.right.data();
         }
 
-        // Cleanup any channels that should be deleted.
-        for (uint32_t channelId : deleteList)
+        // Start scheduled channels at the exact frame within the block.
+        if (pC->startTime < blockEnd)
         {
-            // Delete the associated sound if appropriate.
-            std::uint32_t soundId = channels[channelId]->soundId;
-            if (soundId!=0 && sounds.find(soundId)!=sounds.end())
+            if (pC->startTime > blockClock)
+                begin = static_cast<uint32_t>(pC->startTime-blockClock);
+
+            // A playing channel carries on up to the start, then restarts its sound.
+            if (pC->soundState == SoundState::Playing)
             {
-                std::uint32_t& refCount = sounds[soundId]->refCount;
-                refCount--;
+                std::size_t numFinished = mix.finished.size();
+                MixChannel(voice, 0, std::min(begin, stopFrame), left, right, mix);
+                mix.finished.resize(numFinished); // It isn't finished if it ended before the start.
+                pC->sampleIndex = 0;
+            }
 
-                if (refCount == 0)
-                {
-                    sounds.erase(soundId);
-                    unusedSoundIds.push_front(soundId);
-                }
+            pC->soundState = SoundState::Playing;
+            pC->startTime  = noTime;
+            pC->playTime   = blockClock+begin;
+        }
+
+        // Stop scheduled channels at the exact frame within the block.
+        if (stop)
+            end = std::max(begin, stopFrame);
+
+        MixChannel(voice, begin, end, left, right, mix);
+
+        if (stop)
+        {
+            pC->soundState  = SoundState::Stopped;
+            pC->sampleIndex = 0;
+            pC->stopTime    = noTime;
+        }
+    }
+
+    return;
+}
+
+void Audio::MixChannel(const Voice& voice, uint32_t begin, uint32_t end, float* left,
+                       float* right, MixState& mix)
+{
+    ChannelState* pC = voice.pChannel;
+    const Sound*  pS = voice.pSound;
+
+    uint32_t size  = pS->Size();
+    uint32_t done  = begin;
+
+    // Ramp the gains from their current values to the targets over the frames being mixed, to
+    // avoid zipper noise when the volume or pan changes.
+    float targetLeft;
+    float targetRight;
+    pC->TargetGains(targetLeft, targetRight);
+
+    // Nothing to mix (e.g. stopped at the start of the block).
+    if (end == begin)
+    {
+        pC->gainLeft  = targetLeft;
+        pC->gainRight = targetRight;
+        return;
+    }
+
+    float stepLeft  = (targetLeft-pC->gainLeft)/(end-begin);
+    float stepRight = (targetRight-pC->gainRight)/(end-begin);
+
+    while (done < end)
+    {
+        if (pC->sampleIndex >= size)
+        {
+            // Reached the end of the sound.
+            if (pC->soundEndRule == SoundEndRule::Loop)
+                pC->sampleIndex = 0;
+            else
+            {
+                if (pC->soundEndRule == SoundEndRule::StopAndDeleteChannel)
+                    mix.finished.push_back(voice.channelId);
+
+                pC->soundState = SoundState::Stopped;
+                pC->startTime  = noTime; // Ending cancels the schedule, as Stop() does.
+                break;
             }
+        }
 
-            channels[channelId]->soundId = 0;
+        uint32_t count = std::min(end-done, size-pC->sampleIndex);
+        uint32_t index = pC->sampleIndex;
+        float gainLeft  = pC->gainLeft+stepLeft*(done-begin);
+        float gainRight = pC->gainRight+stepRight*(done-begin);
 
-            // Delete the channel if appropriate.
-            std::uint32_t& refCount = channels[channelId]->refCount;
-            refCount--;
+        if (pS->stream)
+        {
+            float l;
+            float r;
 
-            if (refCount == 0)
+            for (uint32_t n=0; n<count; n++)
             {
-                channels.erase(channelId);
-                unusedChannelIds.push_front(channelId);
+                if (!pS->stream->GetFrame(index+n, l, r))
+                    mix.streamUnderrunFrames++;
+
+                left[done+n]  += (gainLeft+stepLeft*n)*l;
+                right[done+n] += (gainRight+stepRight*n)*r;
             }
         }
+        else
+        if (pS->storage == SampleStorage::Adpcm)
+        {
+            // Decode the blocks covering the frames, then mix from the offset into the first.
+            uint32_t firstBlock = index/Adpcm::blockFrames;
+            uint32_t lastBlock  = (index+count-1)/Adpcm::blockFrames;
+            uint32_t offset     = index-firstBlock*Adpcm::blockFrames;
+
+            for (uint32_t b=firstBlock; b<=lastBlock; b++)
+            {
+                uint32_t to = (b-firstBlock)*Adpcm::blockFrames;
+
+                Adpcm::DecodeBlock(pS->leftAdpcm.data()+b*Adpcm::blockBytes,
+                                   mix.decodeLeft.data()+to);
+                if (!pS->mono)
+                    Adpcm::DecodeBlock(pS->rightAdpcm.data()+b*Adpcm::blockBytes,
+                                       mix.decodeRight.data()+to);
+            }
+
+            const int16_t* pL = mix.decodeLeft.data()+offset;
+            const int16_t* pR = pS->mono ? pL : mix.decodeRight.data()+offset;
+            const float scale = 1/32768.0f;
+            MixSamples(pL, pR, gainLeft*scale, stepLeft*scale, gainRight*scale, stepRight*scale,
+                       left+done, right+done, count);
+        }
+        else
+        if (pS->storage == SampleStorage::Int16)
+        {
+            const int16_t* pL = pS->left16.data()+index;
+            const int16_t* pR = pS->mono ? pL : pS->right16.data()+index;
+            const float scale = 1/32768.0f;
+            MixSamples(pL, pR, gainLeft*scale, stepLeft*scale, gainRight*scale, stepRight*scale,
+                       left+done, right+done, count);
+        }
+        else
+        {
+            const float* pL = pS->left.data()+index;
+            const float* pR = pS->mono ? pL : pS->right.data()+index;
+            MixSamples(pL, pR, gainLeft, stepLeft, gainRight, stepRight,
+                       left+done, right+done, count);
+        }
+
+        pC->sampleIndex += count;
+        done += count;
     }
-    catch(...)
+
+    pC->gainLeft  = targetLeft;
+    pC->gainRight = targetRight;
+
+    return;
+}
+
+void Audio::MixBus(Bus& bus, uint32_t numFrames)
+{
+    if (!bus.used)
     {
-        // We can't let exceptions escape, as this function is being called in a thread.
-        callbackIsGood = false;
+        // Effects such as filters may still have output after their input stops.
+        if (bus.effects.empty())
+            return;
+
+        std::fill(bus.left.begin(),  bus.left.begin()+numFrames,  0.0f);
+        std::fill(bus.right.begin(), bus.right.begin()+numFrames, 0.0f);
+    }
+
+    for (auto& pEffect : bus.effects)
+        pEffect->Process(bus.left.data(), bus.right.data(), numFrames, sampleRate);
+
+    float gain = bus.currentGain;
+    float step = (static_cast<float>(bus.gain)-gain)/numFrames;
+
+    MixSamples(bus.left.data(), bus.right.data(), gain, step, gain, step,
+               mixLeft.data(), mixRight.data(), numFrames);
+
+    bus.currentGain = static_cast<float>(bus.gain);
+    return;
+}
+
+void Audio::MixPrerenderedBus(Bus& bus, uint32_t numFrames)
+{
+    // The ring holds the frames for clock times startClock onwards.
+    uint64_t first     = clock-bus.startClock;
+    uint64_t written   = bus.writeCount.load(std::memory_order_acquire);
+    uint32_t available = (written > first) ? static_cast<uint32_t>(
+        std::min<uint64_t>(written-first, numFrames)) : 0;
+
+    uint32_t mask = static_cast<uint32_t>(bus.ringLeft.size()-1);
+    uint32_t done = 0;
+    float    gain = bus.currentGain;
+    float    step = (static_cast<float>(bus.gain)-gain)/numFrames;
+
+    while (done < available)
+    {
+        // Copy up to the end of the ring buffer at a time.
+        uint32_t index = static_cast<uint32_t>(first+done) & mask;
+        uint32_t count = std::min(available-done, mask+1-index);
+
+        MixSamples(bus.ringLeft.data()+index, bus.ringRight.data()+index,
+                   gain+step*done, step, gain+step*done, step,
+                   mixLeft.data()+done, mixRight.data()+done, count);
+        done += count;
+    }
+
+    stats.prerenderUnderrunFrames += numFrames-available;
+    bus.readCount.store(first+numFrames, std::memory_order_release);
+    bus.currentGain = static_cast<float>(bus.gain);
+
+    return;
+}
+
+void Audio::DeleteChannels()
+{
+    for (uint32_t channelId : deleteList)
+    {
+        // Release the channel's sound, and the channel itself (which the audio object took
+        // ownership of when the sound end rule was set).
+        Channel* pC = channels[channelId].get();
+
+        if (pC->soundId != 0)
+            Release(&sounds[pC->soundId]->refCount);
+
+        pC->soundId      = 0;
+        pC->soundEndRule = SoundEndRule::Stop;
+        Release(&pC->refCount);
+    }
+
+    deleteList.clear();
+    CollectGarbage();
+    return;
+}
+
+void Audio::StartPrerender()
+{
+    prerenderQuit.store(false);
+    prerenderWorker = std::thread(&Audio::Prerender, this);
+    return;
+}
+
+void Audio::StopPrerender()
+{
+    prerenderQuit.store(true);
+
+    if (prerenderWorker.joinable())
+        prerenderWorker.join();
+
+    return;
+}
+
+void Audio::Prerender()
+{
+    while (!prerenderQuit.load())
+    {
+        bool rendered = false;
+
+        for (std::size_t n=0; n<numBuses; n++)
+        {
+            Bus& bus = buses[n];
+            if (!bus.prerender)
+                continue;
+
+            // Frames the callback has already passed don't need rendering.
+            uint64_t read  = bus.readCount.load(std::memory_order_acquire);
+            uint64_t write = std::max(bus.writeCount.load(std::memory_order_relaxed), read);
+
+            if (write+mixBlockFrames-read > bus.aheadFrames)
+                continue;
+
+            // Only hold the mutex while copying the bus's channels and effects, so the callback
+            // isn't kept waiting while they're mixed.
+            {
+                lock_guard<mutex> lock(audioMutex);
+
+                if (!callbackIsGood)
+                    break;
+
+                FindPlaying(prerenderPlaying, &bus);
+                prerenderVoices.clear();
+                prerenderOriginals.clear();
+
+                for (uint32_t channelId : prerenderPlaying)
+                {
+                    Channel* pC = channels[channelId].get();
+                    Sound*   pS = sounds[pC->soundId].get();
+
+                    // Keep the sound while mixing it, and keep the callback from mixing the
+                    // channel (e.g. if it moves to another bus).
+                    AddRef(&pS->refCount);
+                    pC->prerendering = true;
+
+                    prerenderVoices.push_back({channelId, nullptr, pS});
+                    prerenderOriginals.push_back(*pC);
+                }
+
+                prerenderEffects.assign(bus.effects.begin(), bus.effects.end());
+            }
+
+            prerenderChannels.assign(prerenderOriginals.begin(), prerenderOriginals.end());
+
+            for (std::size_t i=0; i<prerenderVoices.size(); i++)
+                prerenderVoices[i].pChannel = &prerenderChannels[i];
+
+            bool failed = false;
+
+            try
+            {
+                bus.used = false;
+                MixChannels(prerenderVoices, bus.startClock+write, mixBlockFrames, prerenderMix);
+
+                if (!bus.used)
+                {
+                    std::fill(bus.left.begin(),  bus.left.end(),  0.0f);
+                    std::fill(bus.right.begin(), bus.right.end(), 0.0f);
+                }
+
+                for (auto& pEffect : prerenderEffects)
+                    pEffect->Process(bus.left.data(), bus.right.data(), mixBlockFrames,
+                                     sampleRate);
+
+                prerenderEffects.clear();
+            }
+            catch(...)
+            {
+                // Same as the callback, this is a thread so exceptions can't escape.
+                failed = true;
+            }
+
+            // Update the channels that haven't been changed (e.g. by a handle) since they were
+            // copied, and delete those that have finished.
+            {
+                lock_guard<mutex> lock(audioMutex);
+
+                for (std::size_t i=0; i<prerenderVoices.size(); i++)
+                {
+                    const Voice&        voice    = prerenderVoices[i];
+                    const ChannelState& original = prerenderOriginals[i];
+                    const ChannelState& mixed    = prerenderChannels[i];
+
+                    Release(&voice.pSound->refCount);
+
+                    // The channel may have been deleted, and its id reused.
+                    auto it = channels.find(voice.channelId);
+                    if (it == channels.end() || !it->second->prerendering)
+                        continue;
+
+                    Channel* pC = it->second.get();
+                    pC->prerendering = false;
+
+                    if (failed || pC->soundId != original.soundId ||
+                        pC->soundState != original.soundState ||
+                        pC->soundEndRule != original.soundEndRule ||
+                        pC->sampleIndex != original.sampleIndex ||
+                        pC->startTime != original.startTime ||
+                        pC->stopTime != original.stopTime || pC->bus != original.bus)
+                        continue;
+
+                    pC->soundState  = mixed.soundState;
+                    pC->sampleIndex = mixed.sampleIndex;
+                    pC->startTime   = mixed.startTime;
+                    pC->stopTime    = mixed.stopTime;
+                    pC->playTime    = mixed.playTime;
+                    pC->gainLeft    = mixed.gainLeft;
+                    pC->gainRight   = mixed.gainRight;
+
+                    auto& finished = prerenderMix.finished;
+                    if (std::find(finished.begin(), finished.end(), voice.channelId)
+                        != finished.end())
+                        deleteList.push_back(voice.channelId);
+                }
+
+                prerenderMix.finished.clear();
+                stats.streamUnderrunFrames += prerenderMix.streamUnderrunFrames;
+                prerenderMix.streamUnderrunFrames = 0;
+
+                try
+                {
+                    DeleteChannels();
+                }
+                catch(...)
+                {
+                    failed = true;
+                }
+
+                if (failed)
+                {
+                    callbackIsGood = false;
+                    break;
+                }
+            }
+
+            // The callback doesn't use the buffers of prerendered buses, so these can be copied
+            // without holding the mutex.
+            uint32_t mask  = static_cast<uint32_t>(bus.ringLeft.size()-1);
+            uint32_t index = static_cast<uint32_t>(write) & mask;
+            uint32_t count = std::min(mixBlockFrames, mask+1-index);
+
+            std::copy_n(bus.left.begin(),  count, bus.ringLeft.begin()+index);
+            std::copy_n(bus.right.begin(), count, bus.ringRight.begin()+index);
+            std::copy_n(bus.left.begin()+count,  mixBlockFrames-count, bus.ringLeft.begin());
+            std::copy_n(bus.right.begin()+count, mixBlockFrames-count, bus.ringRight.begin());
+
+            bus.writeCount.store(write+mixBlockFrames, std::memory_order_release);
+            rendered = true;
+        }
+
+        if (!rendered)
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
     }
 
     return;
 }
 
-void Audio::Init()
+void Audio::Init(const AudioSettings& settings)
 {
     Free();
 
@@ -208,9 +826,9 @@ void Audio::Init()
     SDL_AudioSpec specTarget;
 
     specTarget.format   = AUDIO_S16LSB;
-    specTarget.freq     = 44100;
+    specTarget.freq     = settings.sampleRate;
     specTarget.channels = 2;
-    specTarget.samples  = 1024;
+    specTarget.samples  = settings.bufferFrames;
     specTarget.userdata = static_cast<void*>(this);
     specTarget.callback = Audio::CallbackWrapper;
     specTarget.padding  = 0;
@@ -219,12 +837,34 @@ void Audio::Init()
 
     //DisplayAudioSpec("Target", specTarget);
 
-    device = SDL_OpenAudioDevice(nullptr, 0, &specTarget, &spec, SDL_AUDIO_ALLOW_ANY_CHANGE);
+    maxVoices          = settings.maxVoices;
+    voiceStealing      = settings.voiceStealing;
+    cacheSounds        = settings.cacheSounds;
+    diskCacheDirectory = settings.diskCacheDirectory;
 
-    //DisplayAudioSpec("Spec", spec);
+    // Don't let SDL change the buffer size, otherwise the requested latency may not be met.
+    int allowedChanges = SDL_AUDIO_ALLOW_FORMAT_CHANGE | SDL_AUDIO_ALLOW_CHANNELS_CHANGE;
+    if (settings.allowSampleRateChange)
+        allowedChanges |= SDL_AUDIO_ALLOW_FREQUENCY_CHANGE;
 
-    if (device <= 0)
-        throw error(string("Opening SDL audio device failed: ")+SDL_GetError());
+    offline = settings.offline;
+
+    if (offline)
+    {
+        // Render() calls the callback directly.
+        device      = 0;
+        spec        = specTarget;
+        spec.format = settings.offlineFormat ? settings.offlineFormat : AUDIO_S16SYS;
+    }
+    else
+    {
+        device = SDL_OpenAudioDevice(nullptr, 0, &specTarget, &spec, allowedChanges);
+
+        //DisplayAudioSpec("Spec", spec);
+
+        if (device <= 0)
+            throw error(string("Opening SDL audio device failed: ")+SDL_GetError());
+    }
 
     isSigned    = SDL_AUDIO_MASK_SIGNED   & spec.format;
     isBigEndian = SDL_AUDIO_MASK_ENDIAN   & spec.format;
@@ -233,73 +873,95 @@ void Audio::Init()
 
     // Explicitly store the number of channels, and the sample rate to make it easier to abstract
     // away the SDL layer.
-    numChannels = spec.channels;
-    sampleRate  = spec.freq;
+    numChannels    = spec.channels;
+    sampleRate     = spec.freq;
+    bytesPerSample = numBytes;
+
+    clock = 0;
+
+    stats = AudioStats();
+    stats.sampleRate         = spec.freq;
+    stats.bufferFrames       = spec.samples;
+    stats.budgetMicroseconds = 1e6*spec.samples/spec.freq;
+    callbackMicrosecondsTotal = 0;
+
+    // Allocate the mixing buffers up front, so the callback doesn't have to.
+    mixLeft.resize(mixBlockFrames);
+    mixRight.resize(mixBlockFrames);
+    playing.reserve(64);
+    prerenderPlaying.reserve(64);
+    voices.reserve(64);
+    deleteList.reserve(64);
+    prerenderVoices.reserve(64);
+    prerenderChannels.reserve(64);
+    prerenderOriginals.reserve(64);
+
+    for (MixState* pMix : {&callbackMix, &prerenderMix})
+    {
+        // A mixed block can start part way through an Adpcm block.
+        pMix->decodeLeft.resize(mixBlockFrames+Adpcm::blockFrames);
+        pMix->decodeRight.resize(mixBlockFrames+Adpcm::blockFrames);
+        pMix->finished.reserve(64);
+        pMix->streamUnderrunFrames = 0;
+    }
 
-    if (isBigEndian == systemIsBigEndian)
+    for (std::size_t n=0; n<numBuses; n++)
     {
-        if (isFloat)
-            ConvertDouble = DoubleToFS;
-        else
-        {
-            if (isSigned)
-            {
-                if (numBytes == 1)
-                    ConvertDouble = DoubleTo8SI;
-                else
-                if (numBytes == 2)
-                    ConvertDouble = DoubleTo16SIS;
-                else
-                if (numBytes == 4)
-                    ConvertDouble = DoubleTo32SIS;
-            }
-            else
-            {
-                if (numBytes == 1)
-                    ConvertDouble = DoubleTo8UI;
-                else
-                if (numBytes == 2)
-                    ConvertDouble = DoubleTo16UIS;
-                else
-                if (numBytes == 4)
-                    ConvertDouble = DoubleTo32UIS;
-            }
-        }
+        buses[n].left.assign(mixBlockFrames, 0.0f);
+        buses[n].right.assign(mixBlockFrames, 0.0f);
+    }
+
+    // Pick the conversion routine for the output format once, the callback then only makes one
+    // (non inlined) call per block.
+    bool swapBytes = (isBigEndian != systemIsBigEndian);
+    ConvertBlock   = nullptr;
+
+    if (isFloat)
+    {
+        if (numBytes == 4)
+            ConvertBlock = swapBytes ? ConvertTo<float, true> : ConvertTo<float, false>;
     }
     else
     {
-        if (isFloat)
-            ConvertDouble = DoubleToFN;
+        if (isSigned)
+        {
+            if (numBytes == 1)
+                ConvertBlock = ConvertTo<std::int8_t, false>;
+            else
+            if (numBytes == 2)
+                ConvertBlock = swapBytes ? ConvertTo<std::int16_t, true>
+                                         : ConvertTo<std::int16_t, false>;
+            else
+            if (numBytes == 4)
+                ConvertBlock = swapBytes ? ConvertTo<std::int32_t, true>
+                                         : ConvertTo<std::int32_t, false>;
+        }
         else
         {
-            if (isSigned)
-            {
-                if (numBytes == 1)
-                    ConvertDouble = DoubleTo8SI;
-                else
-                if (numBytes == 2)
-                    ConvertDouble = DoubleTo16SIN;
-                else
-                if (numBytes == 4)
-                    ConvertDouble = DoubleTo32SIN;
-            }
+            if (numBytes == 1)
+                ConvertBlock = ConvertTo<std::uint8_t, false>;
             else
-            {
-                if (numBytes == 1)
-                    ConvertDouble = DoubleTo8UI;
-                else
-                if (numBytes == 2)
-                    ConvertDouble = DoubleTo16UIN;
-                else
-                if (numBytes == 4)
-                    ConvertDouble = DoubleTo32UIN;
-            }
+            if (numBytes == 2)
+                ConvertBlock = swapBytes ? ConvertTo<std::uint16_t, true>
+                                         : ConvertTo<std::uint16_t, false>;
+            else
+            if (numBytes == 4)
+                ConvertBlock = swapBytes ? ConvertTo<std::uint32_t, true>
+                                         : ConvertTo<std::uint32_t, false>;
         }
     }
 
+    if (!ConvertBlock)
+    {
+        if (!offline)
+            SDL_CloseAudioDevice(device);
+        throw error("Unsupported audio device format");
+    }
+
     callbackIsGood = true;
 
-    SDL_PauseAudioDevice(device, 0);
+    if (!offline)
+        SDL_PauseAudioDevice(device, 0);
 
     initialized = true;
     return;
@@ -307,11 +969,14 @@ void Audio::Init()
 
 void Audio::Free()
 {
+    // The worker takes the mutex, so stop it first.
+    StopPrerender();
+
     // Just in case, get the mutex.
     lock_guard<mutex> lock(audioMutex);
 
     // Stop all audio.
-    if (initialized)
+    if (initialized && !offline)
     {
         SDL_PauseAudioDevice(device, 1);
         SDL_CloseAudioDevice(device);
@@ -319,17 +984,192 @@ void Audio::Free()
 
     callbackIsGood = false;
 
-    // Clean the maps.
+    // Clean the maps, keeping anything a handle still refers to. The references the audio object
+    // holds are dropped first, so the detached objects only wait for their handles.
+    for (auto& it : channels)
+    {
+        Channel* pC = it.second.get();
+
+        if (pC->soundId != 0)
+            Release(&sounds[pC->soundId]->refCount);
+
+        if (pC->soundEndRule == SoundEndRule::StopAndDeleteChannel)
+            Release(&pC->refCount);
+
+        pC->soundId      = 0;
+        pC->soundEndRule = SoundEndRule::Stop;
+
+        if (pC->refCount.load() != 0)
+            detachedChannels.push_back(std::move(it.second));
+    }
+
+    for (auto& it : sounds)
+    {
+        if (it.second->refCount.load() != 0)
+            detachedSounds.push_back(std::move(it.second));
+    }
+
     channels.clear();
     unusedChannelIds.clear();
 
     sounds.clear();
     unusedSoundIds.clear();
+    soundCache.clear();
+
+    // Delete any detached objects whose handles have all gone.
+    garbagePending.store(true);
+    CollectGarbage();
+
+    for (std::size_t n=0; n<numBuses; n++)
+    {
+        buses[n].gain        = 1;
+        buses[n].currentGain = 1;
+        buses[n].prerender   = false;
+        buses[n].effects.clear();
+    }
 
     initialized = false;
     return;
 }
 
+void Audio::Render(std::int16_t* output, uint32_t numFrames)
+{
+    if (initialized && spec.format != AUDIO_S16SYS)
+        throw error("Audio::Render() : The offline format isn't 16 bit");
+
+    Render(static_cast<void*>(output), numFrames);
+    return;
+}
+
+void Audio::Render(void* output, uint32_t numFrames)
+{
+    if (!initialized || !offline)
+        throw error("Audio::Render() : Only available in offline mode");
+
+    Callback(static_cast<uint8_t*>(output), numFrames*static_cast<uint32_t>(GetFrameBytes()));
+    return;
+}
+
+long Audio::GetFrameBytes() const
+{
+    lock_guard<mutex> lock(audioMutex);
+    return numChannels*bytesPerSample;
+}
+
+WavHelper Audio::Render(uint32_t numFrames)
+{
+    vector<std::int16_t> interleaved(static_cast<std::size_t>(numFrames)*numChannels);
+    Render(interleaved.data(), numFrames);
+
+    WavHelper wavHelper;
+    wavHelper.sampleRate = sampleRate;
+    wavHelper.amplitudes.assign(numChannels, vector<std::int16_t>(numFrames));
+
+    for (uint32_t n=0; n<numFrames; n++)
+    {
+        for (long c=0; c<numChannels; c++)
+            wavHelper.amplitudes[c][n] = interleaved[n*numChannels+c];
+    }
+
+    return wavHelper;
+}
+
+AudioStats Audio::GetStats() const
+{
+    lock_guard<mutex> lock(audioMutex);
+    return stats;
+}
+
+void Audio::ResetStats()
+{
+    lock_guard<mutex> lock(audioMutex);
+
+    AudioStats reset;
+    reset.sampleRate         = stats.sampleRate;
+    reset.bufferFrames       = stats.bufferFrames;
+    reset.budgetMicroseconds = stats.budgetMicroseconds;
+
+    stats = reset;
+    callbackMicrosecondsTotal = 0;
+    return;
+}
+
+uint64_t Audio::GetClock() const
+{
+    lock_guard<mutex> lock(audioMutex);
+    return clock;
+}
+
+long Audio::GetSampleRate() const
+{
+    lock_guard<mutex> lock(audioMutex);
+    return sampleRate;
+}
+
+void Audio::SetBusGain(AudioBus bus, double gain)
+{
+    lock_guard<mutex> lock(audioMutex);
+    buses[static_cast<std::size_t>(bus)].gain = gain;
+    return;
+}
+
+void Audio::AddBusEffect(AudioBus bus, const std::shared_ptr<AudioEffect>& effect)
+{
+    if (!effect)
+        throw error("Trying to add an invalid effect to an audio bus");
+
+    lock_guard<mutex> lock(audioMutex);
+    buses[static_cast<std::size_t>(bus)].effects.push_back(effect);
+    return;
+}
+
+void Audio::ClearBusEffects(AudioBus bus)
+{
+    lock_guard<mutex> lock(audioMutex);
+    buses[static_cast<std::size_t>(bus)].effects.clear();
+    return;
+}
+
+void Audio::SetBusPrerender(AudioBus bus, bool prerender, uint32_t aheadFrames)
+{
+    if (bus == AudioBus::Master)
+        throw error("The master audio bus can't be prerendered");
+
+    if (offline)
+        return;
+
+    // Reconfigure with the worker stopped, so it isn't using the ring buffer.
+    StopPrerender();
+
+    bool anyPrerendered = false;
+
+    {
+        lock_guard<mutex> lock(audioMutex);
+
+        Bus& b = buses[static_cast<std::size_t>(bus)];
+        b.prerender   = prerender;
+        b.aheadFrames = std::max(aheadFrames, mixBlockFrames);
+        b.startClock  = clock;
+        b.writeCount.store(0);
+        b.readCount.store(0);
+
+        std::size_t ringFrames = 1;
+        while (ringFrames < b.aheadFrames+mixBlockFrames)
+            ringFrames *= 2;
+
+        b.ringLeft.assign(prerender ? ringFrames : 0, 0.0f);
+        b.ringRight.assign(prerender ? ringFrames : 0, 0.0f);
+
+        for (std::size_t n=0; n<numBuses; n++)
+            anyPrerendered = anyPrerendered || buses[n].prerender;
+    }
+
+    if (anyPrerendered)
+        StartPrerender();
+
+    return;
+}
+
 SoundChannelHandle Audio::CreateSoundChannel()
 {
     uint32_t id;
@@ -338,11 +1178,19 @@ SoundChannelHandle Audio::CreateSoundChannel()
     pChannel->soundState   = SoundState::Stopped;
     pChannel->soundEndRule = SoundEndRule::Stop;
     pChannel->volume       = 0;
+    pChannel->pan          = 0;
+    pChannel->gainLeft     = 0;
+    pChannel->gainRight    = 0;
     pChannel->sampleIndex  = 0;
     pChannel->soundId      = 0;
 
+    // The handle takes this reference.
+    RefCount* refCount = &pChannel->refCount;
+    refCount->store(1);
+
     {
         lock_guard<mutex> lock(audioMutex);
+        CollectGarbage();
 
         id = unusedChannelIds.front();
 
@@ -354,28 +1202,96 @@ SoundChannelHandle Audio::CreateSoundChannel()
         channels[id] = std::move(pChannel);
     }
     
-    return SoundChannelHandle(this, id);
+    return SoundChannelHandle(this, id, refCount);
 }
 
-SoundHandle Audio::CreateSound(const string& filename)
+SoundHandle Audio::CreateSound(const string& filename, SampleStorage storage)
 {
+    string cacheKey;
+
+    if (cacheSounds)
+    {
+        cacheKey = "file:"+std::to_string(static_cast<int>(storage))+":"+filename;
+
+        SoundHandle cached = FindCachedSound(cacheKey);
+        if (cached.audio)
+            return cached;
+    }
+
     WavHelper wavHelper;
     wavHelper.Load(filename);
-    return CreateSound(wavHelper);
+    return CreateSound(wavHelper, storage, cacheKey);
 }
 
-SoundHandle Audio::CreateSound(const WavHelper& wavHelper)
+SoundHandle Audio::CreateSound(const WavHelper& wavHelper, SampleStorage storage)
+{
+    string cacheKey;
+
+    if (cacheSounds)
+    {
+        std::ostringstream key;
+        key << "data:" << static_cast<int>(storage) << ":" << std::hex << HashWav(wavHelper);
+        cacheKey = key.str();
+
+        SoundHandle cached = FindCachedSound(cacheKey);
+        if (cached.audio)
+            return cached;
+    }
+
+    return CreateSound(wavHelper, storage, cacheKey);
+}
+
+SoundHandle Audio::CreateSound(const WavHelper& wavHelper, SampleStorage storage,
+                               const string& cacheKey)
 {
-    uint32_t id = 0;
     std::unique_ptr<Sound> pSound = std::make_unique<Sound>();
+    pSound->storage = storage;
+
+    string diskFilename;
+    if (!diskCacheDirectory.empty())
+    {
+        std::ostringstream name;
+        name << diskCacheDirectory << "/" << std::hex << std::setfill('0') << std::setw(16)
+             << HashWav(wavHelper) << std::dec << "_" << sampleRate << "_"
+             << static_cast<int>(storage) << ".pcm";
+        diskFilename = name.str();
+    }
 
-    Convert(sampleRate, wavHelper, pSound.get());
+    if (diskFilename.empty() || !LoadConvertedSound(diskFilename, pSound.get()))
+    {
+        Convert(sampleRate, wavHelper, pSound.get());
+
+        if (!diskFilename.empty())
+            SaveConvertedSound(diskFilename, pSound.get());
+    }
 
-    if (pSound->left.size() == 0)
+    if (pSound->Size() == 0)
         throw error("Sound contains zero samples");
 
+    return AddSound(std::move(pSound), cacheKey);
+}
+
+SoundHandle Audio::CreateStreamingSound(const string& filename)
+{
+    std::unique_ptr<Sound> pSound = std::make_unique<Sound>();
+
+    pSound->stream = std::make_unique<SoundStream>(filename, sampleRate);
+
+    return AddSound(std::move(pSound));
+}
+
+SoundHandle Audio::AddSound(std::unique_ptr<Sound> pSound, const string& cacheKey)
+{
+    uint32_t id = 0;
+    pSound->cacheKey = cacheKey;
+
+    // The handle takes this reference.
+    RefCount* refCount = &pSound->refCount;
+    refCount->store(1);
+
     {
         lock_guard<mutex> lock(audioMutex);
+        CollectGarbage();
 
         id = unusedSoundIds.front();
 
@@ -385,129 +1301,223 @@ SoundHandle Audio::CreateSound(const WavHelper& wavHelper)
             unusedSoundIds.pop_front();
         
         sounds[id] = std::move(pSound);
+
+        if (!cacheKey.empty())
+            soundCache[cacheKey] = id;
     }
 
-    return SoundHandle(this, id);
+    return SoundHandle(this, id, refCount);
 }
 
-void Audio::IncSoundChannelRefCount(std::uint32_t channelId)
+SoundHandle Audio::FindCachedSound(const string& cacheKey)
 {
     lock_guard<mutex> lock(audioMutex);
 
-    auto it = channels.find(channelId);
+    auto it = soundCache.find(cacheKey);
+    if (it == soundCache.end())
+        return SoundHandle();
 
-    if (it == channels.end())
-        throw error("Couldn't find sound channel reference count");
+    // The sound may be waiting to be collected, but as that only happens with the mutex held it
+    // is safe to take a new reference to it.
+    Sound* pSound = sounds[it->second].get();
+    pSound->refCount.fetch_add(1, std::memory_order_relaxed);
 
-    it->second->refCount++;
-    return;
+    return SoundHandle(this, it->second, &pSound->refCount);
 }
 
-void Audio::DecSoundChannelRefCount(std::uint32_t channelId)
+bool Audio::LoadConvertedSound(const string& filename, Sound* pSound) const
 {
-    lock_guard<mutex> lock(audioMutex);
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+        return false;
+
+    // The file is only used on the machine that wrote it, so is in system endian.
+    char          magic[4];
+    std::uint32_t storage;
+    std::uint32_t mono;
+    std::uint32_t numFrames;
+
+    in.read(magic, 4);
+    in.read(reinterpret_cast<char*>(&storage), sizeof(storage));
+    in.read(reinterpret_cast<char*>(&mono), sizeof(mono));
+    in.read(reinterpret_cast<char*>(&numFrames), sizeof(numFrames));
+
+    if (!in || std::memcmp(magic, "MIPC", 4) != 0 ||
+        storage != static_cast<std::uint32_t>(pSound->storage) || numFrames == 0)
+        return false;
+
+    // Check the file holds exactly the samples before allocating for them (it may be corrupt).
+    std::uint64_t channelBytes;
+    if (pSound->storage == SampleStorage::Adpcm)
+        channelBytes = (std::uint64_t(numFrames)+Adpcm::blockFrames-1)/Adpcm::blockFrames
+                       *Adpcm::blockBytes;
+    else
+    if (pSound->storage == SampleStorage::Int16)
+        channelBytes = std::uint64_t(numFrames)*sizeof(std::int16_t);
+    else
+        channelBytes = std::uint64_t(numFrames)*sizeof(float);
 
-    auto it = channels.find(channelId);
-    if (it == channels.end())
-        return; // Already deleted.
+    std::streampos dataStart = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::uint64_t dataBytes = static_cast<std::uint64_t>(in.tellg()-dataStart);
+    in.seekg(dataStart);
 
-    it->second->refCount--;
-    if (it->second->refCount)
-        return;
+    if (!in || dataBytes != channelBytes*(mono?1:2))
+        return false;
 
-    // Delete the associated sound if appropriate.
-    std::uint32_t soundId = it->second->soundId;
-    if (soundId!=0 && sounds.find(soundId)!=sounds.end())
-    {
-        std::uint32_t& refCount = sounds[soundId]->refCount;
-        refCount--;
+    pSound->mono = (mono != 0);
 
-        if (refCount == 0)
+    if (pSound->storage == SampleStorage::Adpcm)
+        pSound->adpcmFrames = numFrames;
+
+    for (long c=0; c<(pSound->mono?1:2); c++)
+    {
+        if (pSound->storage == SampleStorage::Adpcm)
         {
-            sounds.erase(soundId);
-            unusedSoundIds.push_front(soundId);
+            vector<uint8_t>& out = (c==0) ? pSound->leftAdpcm : pSound->rightAdpcm;
+            out.resize((numFrames+Adpcm::blockFrames-1)/Adpcm::blockFrames*Adpcm::blockBytes);
+            in.read(reinterpret_cast<char*>(out.data()), out.size());
+        }
+        else
+        if (pSound->storage == SampleStorage::Int16)
+        {
+            vector<std::int16_t>& out = (c==0) ? pSound->left16 : pSound->right16;
+            out.resize(numFrames);
+            in.read(reinterpret_cast<char*>(out.data()), numFrames*sizeof(std::int16_t));
+        }
+        else
+        {
+            vector<float>& out = (c==0) ? pSound->left : pSound->right;
+            out.resize(numFrames);
+            in.read(reinterpret_cast<char*>(out.data()), numFrames*sizeof(float));
         }
     }
 
-    channels.erase(channelId);
-    unusedChannelIds.push_front(channelId);
+    if (!in)
+    {
+        // Truncated, convert the sound again.
+        pSound->left.clear();
+        pSound->right.clear();
+        pSound->left16.clear();
+        pSound->right16.clear();
+        pSound->leftAdpcm.clear();
+        pSound->rightAdpcm.clear();
+        pSound->adpcmFrames = 0;
+        return false;
+    }
 
-    return;
+    return true;
 }
 
-void Audio::IncSoundRefCount(std::uint32_t soundId)
+void Audio::SaveConvertedSound(const string& filename, const Sound* pSound) const
 {
-    if (soundId == 0)
+    // Failing to write the cache isn't an error, the sound will be converted again next time.
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    if (!out)
         return;
 
-    lock_guard<mutex> lock(audioMutex);
+    std::uint32_t storage   = static_cast<std::uint32_t>(pSound->storage);
+    std::uint32_t mono      = pSound->mono ? 1 : 0;
+    std::uint32_t numFrames = pSound->Size();
 
-    auto it = sounds.find(soundId);
+    out.write("MIPC", 4);
+    out.write(reinterpret_cast<const char*>(&storage), sizeof(storage));
+    out.write(reinterpret_cast<const char*>(&mono), sizeof(mono));
+    out.write(reinterpret_cast<const char*>(&numFrames), sizeof(numFrames));
 
-    if (it == sounds.end())
-        throw error("Couldn't find sound reference count");
+    for (long c=0; c<(pSound->mono?1:2); c++)
+    {
+        if (pSound->storage == SampleStorage::Adpcm)
+        {
+            const vector<uint8_t>& in = (c==0) ? pSound->leftAdpcm : pSound->rightAdpcm;
+            out.write(reinterpret_cast<const char*>(in.data()), in.size());
+        }
+        else
+        if (pSound->storage == SampleStorage::Int16)
+        {
+            const vector<std::int16_t>& in = (c==0) ? pSound->left16 : pSound->right16;
+            out.write(reinterpret_cast<const char*>(in.data()), numFrames*sizeof(std::int16_t));
+        }
+        else
+        {
+            const vector<float>& in = (c==0) ? pSound->left : pSound->right;
+            out.write(reinterpret_cast<const char*>(in.data()), numFrames*sizeof(float));
+        }
+    }
 
-    it->second->refCount++;
     return;
 }
 
-void Audio::DecSoundRefCount(std::uint32_t soundId)
+void Audio::AddRef(RefCount* refCount) noexcept
 {
-    if (soundId == 0)
-        return;
-
-    lock_guard<mutex> lock(audioMutex);
-       
-    auto it = sounds.find(soundId);
+    // Only called by something already holding a reference, so the object can't be deleted.
+    refCount->fetch_add(1, std::memory_order_relaxed);
+    return;
+}
 
-    if (it == sounds.end())
-        return; // Already deleted.
+void Audio::Release(RefCount* refCount) noexcept
+{
+    if (refCount->fetch_sub(1, std::memory_order_acq_rel) == 1)
+        garbagePending.store(true, std::memory_order_release);
 
-    Sound* pSound = it->second.get();
-    pSound->refCount--;
+    return;
+}
 
-    if (pSound->refCount)
+void Audio::CollectGarbage()
+{
+    if (!garbagePending.exchange(false, std::memory_order_acquire))
         return;
 
-    vector<uint32_t> deleteList;
-
-    // Check which channels are playing the sound and stop them.
-    for (auto& it : channels)
+    // Delete the channels first, as they hold references to their sounds.
+    for (auto it = channels.begin(); it != channels.end();)
     {
-        if (it.second && it.second->soundId == soundId)
+        if (it->second->refCount.load(std::memory_order_acquire) != 0)
         {
-            // Check if we should delete the channel.
-            if (it.second->soundEndRule == SoundEndRule::StopAndDeleteChannel)
-                deleteList.push_back(it.first);
-
-            it.second->soundState = SoundState::Stopped;
-            it.second->soundId    = 0;
+            ++it;
+            continue;
         }
-    }
 
-    sounds.erase(soundId);
-    unusedSoundIds.push_front(soundId);
+        std::uint32_t soundId = it->second->soundId;
+        if (soundId != 0)
+            Release(&sounds[soundId]->refCount);
 
-    // Cleanup any channels that should be deleted.
-    for (uint32_t channelId : deleteList)
+        unusedChannelIds.push_front(it->first);
+        it = channels.erase(it);
+    }
+
+    for (auto it = sounds.begin(); it != sounds.end();)
     {
-        std::uint32_t& refCount = channels[channelId]->refCount;
-        refCount--;
+        if (it->second->refCount.load(std::memory_order_acquire) != 0)
+        {
+            ++it;
+            continue;
+        }
 
-        if (refCount == 0)
+        const string& cacheKey = it->second->cacheKey;
+        if (!cacheKey.empty())
         {
-            channels.erase(channelId);
-            unusedChannelIds.push_front(channelId);
+            auto cached = soundCache.find(cacheKey);
+            if (cached != soundCache.end() && cached->second == it->first)
+                soundCache.erase(cached);
         }
+
+        unusedSoundIds.push_front(it->first);
+        it = sounds.erase(it);
     }
 
+    // Objects detached by Free() only have handle references left.
+    std::erase_if(detachedChannels, [](const std::unique_ptr<Channel>& pChannel)
+                  { return pChannel->refCount.load(std::memory_order_acquire) == 0; });
+    std::erase_if(detachedSounds, [](const std::unique_ptr<Sound>& pSound)
+                  { return pSound->refCount.load(std::memory_order_acquire) == 0; });
+
     return;
 }
 
 void Audio::Convert(unsigned long targetSampleRate, const WavHelper& wavHelper, Sound* pSound)
 {
     // Only consider the first two channels of the input.
-    // If there is only one channel duplicate it to get two channels.
+    // If there is only one channel it is only stored once (Sound::mono).
 
     vector<double> leftChannel;
     vector<double> rightChannel;
@@ -520,40 +1530,51 @@ void Audio::Convert(unsigned long targetSampleRate, const WavHelper& wavHelper,
         numSamples = static_cast<unsigned long>(wavHelper.amplitudes[0].size());
 
     if (numSamples <= 1)
-        throw "Audio.Convert() : Not enough samples";
+        throw error("Audio.Convert() : Not enough samples");
+
+    pSound->mono = (numChannels == 1);
 
     // Fill in the left channel.
+    leftChannel.reserve(numSamples);
     for (size_t n=0; n<numSamples; n++)
         leftChannel.push_back(wavHelper.amplitudes[0][n]/32768.0);
 
     // Fill in the right channel.
-    if (numChannels <= 1)
-        rightChannel = leftChannel;
-    else
+    if (!pSound->mono)
     {
+        rightChannel.reserve(numSamples);
         for (size_t n=0; n<numSamples; n++)
             rightChannel.push_back(wavHelper.amplitudes[1][n]/32768.0);
     }
 
     // Interpolate frequency.
-    vector<float>  temp;
     vector<double> channel;
     double totalSamples = (leftChannel.size()-1)
                           *static_cast<double>(targetSampleRate)/wavHelper.sampleRate
                           +1;
+    size_t numOutput = static_cast<size_t>(std::ceil(totalSamples));
 
-    for (long c=0; c<2; c++)
+    for (long c=0; c<(pSound->mono?1:2); c++)
     {
         if (c==0)
             channel.swap(leftChannel);
         else
             channel.swap(rightChannel);
 
-        temp.clear();
-        temp.push_back(static_cast<float>(channel[0]));
-        while (temp.size() < totalSamples)
+        vector<float>&        outFloat = (c==0) ? pSound->left   : pSound->right;
+        vector<std::int16_t>& outInt16 = (c==0) ? pSound->left16 : pSound->right16;
+
+        // Adpcm sounds are converted to 16 bit first, then encoded.
+        bool toInt16 = (pSound->storage != SampleStorage::Float);
+
+        if (toInt16)
+            outInt16.resize(numOutput);
+        else
+            outFloat.resize(numOutput);
+
+        for (size_t n=0; n<numOutput; n++)
         {
-            double index  = (temp.size())*static_cast<double>(wavHelper.sampleRate)/targetSampleRate;
+            double index  = n*static_cast<double>(wavHelper.sampleRate)/targetSampleRate;
             long   lower  = static_cast<long>(index);
             long   upper  = lower+1;
             double factor = index-lower;
@@ -561,160 +1582,95 @@ void Audio::Convert(unsigned long targetSampleRate, const WavHelper& wavHelper,
             if (lower <= 0)
                 lower = 0;
 
+            if (lower >= static_cast<long>(channel.size()))
+                lower = static_cast<long>(channel.size()-1);
+
             if (upper >= static_cast<long>(channel.size()))
                 upper = static_cast<long>(channel.size()-1);
 
-            temp.push_back(static_cast<float>(channel[lower]*(1-factor)+channel[upper]*factor));
+            double value = channel[lower]*(1-factor)+channel[upper]*factor;
+
+            if (toInt16)
+            {
+                value = std::round(value*32768);
+                outInt16[n] = static_cast<std::int16_t>(std::clamp(value, -32768.0, 32767.0));
+            }
+            else
+                outFloat[n] = static_cast<float>(value);
         }
 
-        if (c==0)
-            temp.swap(pSound->left);
-        else
-            temp.swap(pSound->right);
+        if (pSound->storage == SampleStorage::Adpcm)
+        {
+            Adpcm::Encode(outInt16.data(), numOutput, (c==0) ? pSound->leftAdpcm
+                                                            : pSound->rightAdpcm);
+            vector<std::int16_t>().swap(outInt16);
+        }
     }
 
-    return;
-}
-
-void Audio::DoubleTo8UI(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    std::uint8_t z   = static_cast<std::uint8_t>((input+1)/2 * 255);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[0];
-    buffer += 1;
-    length -= 1;
-    return;
-}
-
-void Audio::DoubleTo8SI(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    std::int8_t z   = static_cast<std::int8_t>(input*127);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[0];
-    buffer += 1;
-    length -= 1;
-    return;
-}
+    if (pSound->storage == SampleStorage::Adpcm)
+        pSound->adpcmFrames = static_cast<uint32_t>(numOutput);
 
-void Audio::DoubleTo16UIS(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    std::uint16_t z  = static_cast<std::uint16_t>((input+1)/2 * 65535);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[0];
-    buffer[1] = pBytes[1];
-    buffer += 2;
-    length -= 2;
     return;
 }
 
-void Audio::DoubleTo16UIN(double input, std::uint8_t*& buffer, std::uint32_t& length)
+void Audio::OutputSilence(uint8_t* stream, uint32_t length)
 {
-    std::uint16_t z  = static_cast<std::uint16_t>((input+1)/2 * 65535);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[1];
-    buffer[1] = pBytes[0];
-    buffer += 2;
-    length -= 2;
-    return;
-}
+    uint32_t frameBytes = static_cast<uint32_t>(bytesPerSample*numChannels);
 
-void Audio::DoubleTo16SIS(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    std::int16_t z  = static_cast<std::int16_t>(input*32767);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[0];
-    buffer[1] = pBytes[1];
-    buffer += 2;
-    length -= 2;
-    return;
-}
+    if (!ConvertBlock || frameBytes == 0)
+    {
+        std::memset(stream, 0, length);
+        return;
+    }
 
-void Audio::DoubleTo16SIN(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    std::int16_t z  = static_cast<std::int16_t>(input*32767);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[1];
-    buffer[1] = pBytes[0];
-    buffer += 2;
-    length -= 2;
-    return;
-}
+    std::fill(mixLeft.begin(),  mixLeft.end(),  0.0f);
+    std::fill(mixRight.begin(), mixRight.end(), 0.0f);
 
-void Audio::DoubleTo32UIS(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    std::uint32_t z = static_cast<std::uint32_t>((input+1)/2 * 4294967295);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[0];
-    buffer[1] = pBytes[1];
-    buffer[2] = pBytes[2];
-    buffer[3] = pBytes[3];
-    buffer += 4;
-    length -= 4;
-    return;
-}
+    while (length >= frameBytes)
+    {
+        uint32_t numFrames = std::min(length/frameBytes, static_cast<uint32_t>(mixLeft.size()));
+        ConvertBlock(mixLeft.data(), mixRight.data(), numChannels, numFrames, stream);
+        stream += numFrames*frameBytes;
+        length -= numFrames*frameBytes;
+    }
 
-void Audio::DoubleTo32UIN(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    std::uint32_t z = static_cast<std::uint32_t>((input+1)/2 * 4294967295);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[3];
-    buffer[1] = pBytes[2];
-    buffer[2] = pBytes[1];
-    buffer[3] = pBytes[0];
-    buffer += 4;
-    length -= 4;
+    std::memset(stream, 0, length);
     return;
 }
 
-void Audio::DoubleTo32SIS(double input, std::uint8_t*& buffer, std::uint32_t& length)
+template<typename T, bool swapBytes>
+void Audio::ConvertTo(const float* left, const float* right, long numChannels,
+                      uint32_t numFrames, uint8_t* buffer)
 {
-    std::int32_t z  = static_cast<std::int32_t>(input*2147483647);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[0];
-    buffer[1] = pBytes[1];
-    buffer[2] = pBytes[2];
-    buffer[3] = pBytes[3];
-    buffer += 4;
-    length -= 4;
-    return;
-}
+    if (numChannels == 1)
+    {
+        for (uint32_t n=0; n<numFrames; n++)
+            StoreSample<T, swapBytes>(Clamp((left[n]+right[n])*0.5f), buffer+n*sizeof(T));
+    }
+    else
+    if (numChannels == 2)
+    {
+        for (uint32_t n=0; n<numFrames; n++)
+        {
+            StoreSample<T, swapBytes>(Clamp(left[n]),  buffer+(2*n)*sizeof(T));
+            StoreSample<T, swapBytes>(Clamp(right[n]), buffer+(2*n+1)*sizeof(T));
+        }
+    }
+    else
+    {
+        // Only the first two channels are used, the rest are silent.
+        for (uint32_t n=0; n<numFrames; n++)
+        {
+            uint8_t* frame = buffer+n*numChannels*sizeof(T);
 
-void Audio::DoubleTo32SIN(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    std::int32_t z  = static_cast<std::int32_t>(input*2147483647);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&z);
-    buffer[0] = pBytes[3];
-    buffer[1] = pBytes[2];
-    buffer[2] = pBytes[1];
-    buffer[3] = pBytes[0];
-    buffer += 4;
-    length -= 4;
-    return;
-}
+            StoreSample<T, swapBytes>(Clamp(left[n]),  frame);
+            StoreSample<T, swapBytes>(Clamp(right[n]), frame+sizeof(T));
 
-void Audio::DoubleToFS(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    float f = static_cast<float>(input);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&f);
-    buffer[0] = pBytes[0];
-    buffer[1] = pBytes[1];
-    buffer[2] = pBytes[2];
-    buffer[3] = pBytes[3];
-    buffer += 4;
-    length -= 4;
-    return;
-}
+            for (long c=2; c<numChannels; c++)
+                StoreSample<T, swapBytes>(0.0f, frame+c*sizeof(T));
+        }
+    }
 
-void Audio::DoubleToFN(double input, std::uint8_t*& buffer, std::uint32_t& length)
-{
-    float f = static_cast<float>(input);
-    uint8_t* pBytes = reinterpret_cast<uint8_t*>(&f);
-    buffer[0] = pBytes[3];
-    buffer[1] = pBytes[2];
-    buffer[2] = pBytes[1];
-    buffer[3] = pBytes[0];
-    buffer += 4;
-    length -= 4;
     return;
 }
 
@@ -1,7 +1,11 @@
 #pragma once
 
+#include "Adpcm.h"
+#include "AudioEffects.h"
+#include "AudioSettings.h"
 #include "SoundChannelHandle.h"
 #include "SoundHandle.h"
+#include "SoundStream.h"
 #include "WavHelper.h"
 #include <cstdint>
 #include <vector>
@@ -9,8 +13,10 @@
 #include <deque>
 #include <unordered_map>
 #include <string>
-#include <functional>
 #include <memory>
+#include <algorithm>
+#include <thread>
+#include <atomic>
 #include <SDL.h>
 
 namespace mi
@@ -22,78 +28,282 @@ public:
     Audio();
     ~Audio();
 
-    void Init();
+    void Init(const AudioSettings& settings = AudioSettings());
     void Free();
 
+    // Only available in offline mode (see AudioSettings::offline), mixes the next numFrames frames
+    // as interleaved 16 bit stereo, or into a WavHelper (e.g. to be saved).
+    void      Render(std::int16_t* output, std::uint32_t numFrames);
+    WavHelper Render(std::uint32_t numFrames);
+    // As above, in AudioSettings::offlineFormat. output must hold numFrames*GetFrameBytes() bytes.
+    void      Render(void* output, std::uint32_t numFrames);
+    long      GetFrameBytes() const;
+
+    AudioStats GetStats() const;
+    void       ResetStats();
+
+    // The number of frames mixed since Init(), i.e. the time (in frames at GetSampleRate()) of the
+    // next frame to be mixed. It is heard roughly one buffer later.
+    std::uint64_t GetClock() const;
+    long          GetSampleRate() const;
+
+    // Gain changes are smoothed over the next mixed block.
+    void SetBusGain(AudioBus bus, double gain);
+    // Effects are applied in the order they are added.
+    void AddBusEffect(AudioBus bus, const std::shared_ptr<AudioEffect>& effect);
+    void ClearBusEffects(AudioBus bus);
+    // A prerendered bus is mixed (including its effects) up to aheadFrames ahead of time on a
+    // worker thread, so the callback only has to add the result. Changes to its channels (other
+    // than the bus gain) are delayed by up to aheadFrames. Best set before the bus's channels
+    // start playing, as there may be a short gap. Its effects run on the worker thread, so don't
+    // also add them to another bus. The Master bus can't be prerendered, and in offline mode all
+    // buses are mixed by Render() (so the output is deterministic).
+    void SetBusPrerender(AudioBus bus, bool prerender, std::uint32_t aheadFrames = 4096);
+
     SoundChannelHandle CreateSoundChannel();
-    SoundHandle        CreateSound(const std::string& filename);
-    SoundHandle        CreateSound(const WavHelper& wavHelper);
+    SoundHandle        CreateSound(const std::string& filename,
+                                   SampleStorage storage = SampleStorage::Float);
+    SoundHandle        CreateSound(const WavHelper& wavHelper,
+                                   SampleStorage storage = SampleStorage::Float);
+    // The file is read and converted while it plays, so memory use doesn't depend on its length.
+    SoundHandle        CreateStreamingSound(const std::string& filename);
 
 private:
     static void CallbackWrapper(void* userData, std::uint8_t* stream, int length);
     void Callback(std::uint8_t *stream, std::uint32_t length);
+    // Stops the lowest priority channels until at most maxVoices are playing before the clock
+    // reaches callbackEnd (counting those scheduled to start by then).
+    void StealVoices(std::uint64_t callbackEnd);
+    class Bus;
+    class Voice;
+    class MixState;
+
+    // Finds the channels that are playing (or scheduled to), either those on the given bus, or if
+    // pBus is null those on buses that aren't prerendered.
+    void FindPlaying(std::vector<std::uint32_t>& list, const Bus* pBus);
+    // Mixes the voices into their buses, for numFrames starting at blockClock. Only uses the
+    // voices, their buses and mix, so the prerender worker can call it without the mutex.
+    void MixChannels(const std::vector<Voice>& voices, std::uint64_t blockClock,
+                     std::uint32_t numFrames, MixState& mix);
+    // Adds the voice's sound to frames [begin, end) of left and right.
+    void MixChannel(const Voice& voice, std::uint32_t begin, std::uint32_t end,
+                    float* left, float* right, MixState& mix);
+    // Applies the bus's effects and adds it (with its gain) to mixLeft and mixRight.
+    void MixBus(Bus& bus, std::uint32_t numFrames);
+    // Adds the bus's prerendered frames for the current clock to mixLeft and mixRight.
+    void MixPrerenderedBus(Bus& bus, std::uint32_t numFrames);
+    // Deletes the channels in deleteList (and their sounds if no longer used).
+    void DeleteChannels();
+
+    void StartPrerender();
+    void StopPrerender();
+    void Prerender();
 
-    void IncSoundChannelRefCount(std::uint32_t channelId);
-    void DecSoundChannelRefCount(std::uint32_t channelId);
-    void IncSoundRefCount(std::uint32_t soundId);
-    void DecSoundRefCount(std::uint32_t soundId);
+    // Handles keep a pointer to the reference count of their sound or channel, so copying them
+    // doesn't need the mutex. Objects are deleted by CollectGarbage() (with the mutex held) once
+    // their count reaches zero.
+    using RefCount = std::atomic<std::uint32_t>;
+    static void AddRef(RefCount* refCount) noexcept;
+    void        Release(RefCount* refCount) noexcept;
+    void        CollectGarbage();
+
+    std::atomic<bool> garbagePending{false};
 
     bool initialized;
+    bool offline;
     bool callbackIsGood;
     bool systemIsBigEndian;
     long numChannels;
     long sampleRate;
-    std::function<void(double, std::uint8_t*&, std::uint32_t&)> ConvertDouble;
+    long bytesPerSample;
+    
+    std::uint64_t     clock;
+    std::uint32_t     maxVoices;
+    VoiceStealing     voiceStealing;
+    AudioStats        stats;
+    double            callbackMicrosecondsTotal;
     
     SDL_AudioDeviceID device;
     SDL_AudioSpec     spec;
 
-    // Conversion routines from double to 8/16/32 bit Signed/Unsigned Float/Integer in System/Not
-    // System endian.
-    static void DoubleTo8UI  (double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo8SI  (double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo16UIS(double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo16UIN(double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo16SIS(double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo16SIN(double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo32UIS(double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo32UIN(double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo32SIS(double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleTo32SIN(double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleToFS   (double input, std::uint8_t*& buffer, std::uint32_t& length);
-    static void DoubleToFN   (double input, std::uint8_t*& buffer, std::uint32_t& length);
+    // Clamps the mixed channels to [-1, 1] and writes numFrames frames to buffer in the output
+    // format. Chosen once in Init() from the instantiations of ConvertTo().
+    using ConvertFunction = void (*)(const float* left, const float* right, long numChannels,
+                                     std::uint32_t numFrames, std::uint8_t* buffer);
+    ConvertFunction ConvertBlock = nullptr;
+
+    // T is the output sample type, swapBytes is set if the output is not in system endian.
+    template<typename T, bool swapBytes>
+    static void ConvertTo(const float* left, const float* right, long numChannels,
+                          std::uint32_t numFrames, std::uint8_t* buffer);
+
+    void OutputSilence(std::uint8_t* stream, std::uint32_t length);
 
     mutable std::mutex audioMutex;
 
     class Sound
     {
     public:
-        std::vector<float> left;
-        std::vector<float> right;
+        // Only one of these pairs is used depending on storage, mono sounds only use the left.
+        std::vector<float>        left;
+        std::vector<float>        right;
+        std::vector<std::int16_t> left16;
+        std::vector<std::int16_t> right16;
+        std::vector<std::uint8_t> leftAdpcm;  // Blocks of Adpcm::blockFrames frames.
+        std::vector<std::uint8_t> rightAdpcm;
+        std::uint32_t             adpcmFrames = 0;
+        std::unique_ptr<SoundStream> stream; // Only set for streaming sounds (no samples stored).
+
+        SampleStorage storage = SampleStorage::Float;
+        bool          mono    = false;
+        std::string   cacheKey; // Empty if not in the sound cache.
+
+        RefCount refCount{0};
+
+        std::uint32_t Size() const
+        {
+            if (stream)
+                return stream->Size();
+
+            if (storage == SampleStorage::Int16)
+                return static_cast<std::uint32_t>(left16.size());
+
+            if (storage == SampleStorage::Adpcm)
+                return adpcmFrames;
 
-        std::uint32_t refCount = 0;
+            return static_cast<std::uint32_t>(left.size());
+        }
     };
 
-    class Channel
+    // The part of a channel used while mixing, copied by the prerender worker so it can mix
+    // without holding the mutex.
+    class ChannelState
     {
     public:
         SoundState    soundState;
         SoundEndRule  soundEndRule;
         double        volume;
+        double        pan; // -1 (left) to 1 (right).
+        // The gains last applied, these are ramped towards the TargetGains() while mixing.
+        float         gainLeft;
+        float         gainRight;
         std::uint32_t sampleIndex; // Next to be used.
         std::uint32_t soundId;
+        // Clock times set by PlayAt() and StopAt(), noTime if not scheduled.
+        std::uint64_t startTime = noTime;
+        std::uint64_t stopTime  = noTime;
+        std::uint64_t playTime  = 0; // Clock time it last started playing.
+        AudioBus      bus       = AudioBus::Effects;
+        int           priority  = 0;
 
-        std::uint32_t refCount = 0;
+        // Panning reduces the volume of the opposite side (so a centred sound is unchanged).
+        void TargetGains(float& left, float& right) const
+        {
+            left  = static_cast<float>(volume*std::min(1.0, 1.0-pan));
+            right = static_cast<float>(volume*std::min(1.0, 1.0+pan));
+            return;
+        }
     };
 
+    class Channel : public ChannelState
+    {
+    public:
+        bool     prerendering = false; // A copy is being mixed by the prerender worker.
+        RefCount refCount{0};
+    };
+
+    // A channel to be mixed, and its sound.
+    class Voice
+    {
+    public:
+        std::uint32_t channelId;
+        ChannelState* pChannel;
+        Sound*        pSound;
+    };
+
+    // The buffers and results of mixing, one for the callback and one for the prerender worker.
+    class MixState
+    {
+    public:
+        // Adpcm sounds are decoded into these (a block at a time) before being mixed.
+        std::vector<std::int16_t>  decodeLeft;
+        std::vector<std::int16_t>  decodeRight;
+        std::vector<std::uint32_t> finished; // StopAndDeleteChannel channels that have ended.
+        std::uint64_t              streamUnderrunFrames = 0;
+    };
+
+    static const std::uint64_t noTime = UINT64_MAX;
+
     static void Convert(unsigned long targetSampleRate, const WavHelper& wavHelper,
                         Sound* pSound);
 
+    // Converts the sound (or loads it from the disk cache), cacheKey is empty if not cached.
+    SoundHandle CreateSound(const WavHelper& wavHelper, SampleStorage storage,
+                            const std::string& cacheKey);
+    SoundHandle AddSound(std::unique_ptr<Sound> pSound, const std::string& cacheKey = "");
+    // Returns an empty handle if the key isn't in the cache.
+    SoundHandle FindCachedSound(const std::string& cacheKey);
+    // Saves and loads converted samples in diskCacheDirectory. Load returns false on failure.
+    bool LoadConvertedSound(const std::string& filename, Sound* pSound) const;
+    void SaveConvertedSound(const std::string& filename, const Sound* pSound) const;
+
+    // Mixing is done in blocks of (at most) mixBlockFrames.
+    static constexpr std::uint32_t mixBlockFrames = 512;
+    std::vector<float>         mixLeft;
+    std::vector<float>         mixRight;
+    std::vector<std::uint32_t> playing;
+    std::vector<Voice>         voices;
+    std::vector<std::uint32_t> deleteList;
+    MixState                   callbackMix;
+
+    class Bus
+    {
+    public:
+        double             gain        = 1;
+        float              currentGain = 1; // Ramped towards gain while mixing.
+        std::vector<std::shared_ptr<AudioEffect>> effects;
+        std::vector<float> left;
+        std::vector<float> right;
+        bool               used        = false; // Set once a channel is mixed into the block.
+
+        // Prerendering data, the ring buffer holds the frames for clock times startClock+count.
+        bool                       prerender   = false; // Only changed with the worker stopped.
+        std::uint32_t              aheadFrames = 0;
+        std::uint64_t              startClock  = 0;
+        std::vector<float>         ringLeft;  // Size is a power of 2.
+        std::vector<float>         ringRight;
+        std::atomic<std::uint64_t> writeCount{0};
+        std::atomic<std::uint64_t> readCount{0};
+    };
+
+    static const std::size_t numBuses = 4;
+    Bus buses[numBuses]; // Indexed by AudioBus.
+
+    // The worker mixes copies of its channels (the originals are kept to see if they changed).
+    std::vector<std::uint32_t> prerenderPlaying;
+    std::vector<Voice>         prerenderVoices;
+    std::vector<ChannelState>  prerenderChannels;
+    std::vector<ChannelState>  prerenderOriginals;
+    std::vector<std::shared_ptr<AudioEffect>> prerenderEffects;
+    MixState                   prerenderMix;
+    std::thread                prerenderWorker;
+    std::atomic<bool>          prerenderQuit{false};
+
     std::unordered_map<std::uint32_t, std::unique_ptr<Channel>> channels;
     std::deque<std::uint32_t> unusedChannelIds;
     std::unordered_map<std::uint32_t, std::unique_ptr<Sound>> sounds;
     std::deque<std::uint32_t> unusedSoundIds;
 
+    // Sound ids by cache key, see AudioSettings::cacheSounds.
+    bool        cacheSounds;
+    std::string diskCacheDirectory;
+    std::unordered_map<std::string, std::uint32_t> soundCache;
+
+    // Objects still referenced by handles when Free() is called, kept so the handles remain safe
+    // to copy and destroy (CollectGarbage() deletes them once the handles have gone).
+    std::vector<std::unique_ptr<Channel>> detachedChannels;
+    std::vector<std::unique_ptr<Sound>>   detachedSounds;
+
     friend class SoundChannelHandle;
     friend class SoundHandle;
 };
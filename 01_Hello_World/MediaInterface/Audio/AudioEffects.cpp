@@ -0,0 +1,129 @@
+#include "AudioEffects.h"
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+
+using std::uint32_t;
+
+namespace
+{
+
+const double pi = 3.14159265358979323846;
+
+// The coefficient of a one pole smoother which moves ~63% of the way to its target in timeMs.
+float SmoothingCoefficient(double timeMs, long sampleRate)
+{
+    if (timeMs <= 0)
+        return 1;
+
+    return static_cast<float>(1-std::exp(-1000.0/(timeMs*sampleRate)));
+}
+
+} // End of anonymous namespace.
+
+namespace mi
+{
+
+LowPassFilter::LowPassFilter(double cutoffHz)
+{
+    this->cutoffHz = cutoffHz;
+    return;
+}
+
+void LowPassFilter::Process(float* left, float* right, uint32_t numFrames, long sampleRate)
+{
+    if (coefficientRate != sampleRate)
+    {
+        coefficient     = static_cast<float>(1-std::exp(-2*pi*cutoffHz/sampleRate));
+        coefficientRate = sampleRate;
+    }
+
+    float l = lastLeft;
+    float r = lastRight;
+
+    for (uint32_t n=0; n<numFrames; n++)
+    {
+        l += coefficient*(left[n]-l);
+        r += coefficient*(right[n]-r);
+        left[n]  = l;
+        right[n] = r;
+    }
+
+    lastLeft  = l;
+    lastRight = r;
+    return;
+}
+
+Compressor::Compressor(double thresholdDb, double ratio, double attackMs, double releaseMs,
+                       double makeupDb)
+{
+    this->thresholdDb = thresholdDb;
+    this->ratio       = std::max(ratio, 1.0);
+    this->attackMs    = attackMs;
+    this->releaseMs   = releaseMs;
+    makeup = static_cast<float>(std::pow(10.0, makeupDb/20));
+    return;
+}
+
+void Compressor::Process(float* left, float* right, uint32_t numFrames, long sampleRate)
+{
+    if (coefficientRate != sampleRate)
+    {
+        attack          = SmoothingCoefficient(attackMs, sampleRate);
+        release         = SmoothingCoefficient(releaseMs, sampleRate);
+        coefficientRate = sampleRate;
+    }
+
+    const float threshold = static_cast<float>(std::pow(10.0, thresholdDb/20));
+    const float slope     = static_cast<float>(1-1/ratio);
+
+    for (uint32_t n=0; n<numFrames; n++)
+    {
+        // Follow the level of the louder side.
+        float level = std::max(std::fabs(left[n]), std::fabs(right[n]));
+        envelope += (level > envelope ? attack : release)*(level-envelope);
+
+        float gain = makeup;
+        if (envelope > threshold)
+            gain *= std::pow(threshold/envelope, slope);
+
+        left[n]  *= gain;
+        right[n] *= gain;
+    }
+
+    return;
+}
+
+Limiter::Limiter(double ceiling, double releaseMs)
+{
+    this->ceiling   = static_cast<float>(ceiling);
+    this->releaseMs = releaseMs;
+    return;
+}
+
+void Limiter::Process(float* left, float* right, uint32_t numFrames, long sampleRate)
+{
+    if (coefficientRate != sampleRate)
+    {
+        release         = SmoothingCoefficient(releaseMs, sampleRate);
+        coefficientRate = sampleRate;
+    }
+
+    for (uint32_t n=0; n<numFrames; n++)
+    {
+        float peak   = std::max(std::fabs(left[n]), std::fabs(right[n]));
+        float target = (peak > ceiling) ? ceiling/peak : 1.0f;
+
+        if (target < gain)
+            gain = target;
+        else
+            gain += release*(target-gain);
+
+        left[n]  *= gain;
+        right[n] *= gain;
+    }
+
+    return;
+}
+
+} // End of namespace mi.
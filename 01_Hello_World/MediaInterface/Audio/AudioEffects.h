@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+
+namespace mi
+{
+
+// An effect that can be added to an audio bus (see MediaInterface::AddBusEffect()).
+// Process() is called from the audio thread with the audio mutex held, so it mustn't block or
+// allocate, and the effect shouldn't be used elsewhere once added.
+class AudioEffect
+{
+public:
+    virtual ~AudioEffect() = default;
+
+    // Processes numFrames frames of the bus in place.
+    virtual void Process(float* left, float* right, std::uint32_t numFrames, long sampleRate) = 0;
+};
+
+// Removes frequencies above the cutoff (a one pole filter, so gently).
+class LowPassFilter : public AudioEffect
+{
+public:
+    explicit LowPassFilter(double cutoffHz);
+
+    void Process(float* left, float* right, std::uint32_t numFrames, long sampleRate) override;
+
+private:
+    double cutoffHz;
+    long   coefficientRate = 0; // The sample rate the coefficient was calculated for.
+    float  coefficient     = 1;
+    float  lastLeft        = 0;
+    float  lastRight       = 0;
+};
+
+// Reduces the volume of the bus when it is louder than the threshold, by the given ratio.
+class Compressor : public AudioEffect
+{
+public:
+    explicit Compressor(double thresholdDb = -18.0,
+                        double ratio       = 4.0,
+                        double attackMs    = 5.0,
+                        double releaseMs   = 100.0,
+                        double makeupDb    = 0.0);
+
+    void Process(float* left, float* right, std::uint32_t numFrames, long sampleRate) override;
+
+private:
+    double thresholdDb;
+    double ratio;
+    double attackMs;
+    double releaseMs;
+    float  makeup;
+    long   coefficientRate = 0;
+    float  attack          = 0;
+    float  release         = 0;
+    float  envelope        = 0;
+};
+
+// Stops the bus going above the ceiling (linear amplitude), the gain drops instantly and recovers
+// over the release time.
+class Limiter : public AudioEffect
+{
+public:
+    explicit Limiter(double ceiling = 0.98, double releaseMs = 50.0);
+
+    void Process(float* left, float* right, std::uint32_t numFrames, long sampleRate) override;
+
+private:
+    float  ceiling;
+    double releaseMs;
+    long   coefficientRate = 0;
+    float  release         = 0;
+    float  gain            = 1;
+};
+
+} // End of namespace mi.
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+namespace mi
+{
+
+// Which playing channel is stopped when starting another would exceed AudioSettings::maxVoices.
+// Channels with a lower priority are always stopped first.
+enum class VoiceStealing: std::uint8_t
+{
+    Oldest,  // The channel that started playing first.
+    Quietest // The channel with the lowest volume.
+};
+
+// The audio device settings requested in Audio::Init().
+// Smaller buffers reduce the latency (the delay before a sound is heard), but the callback has
+// less time to mix each buffer and any that are late will be heard as clicks.
+class AudioSettings
+{
+public:
+    long          sampleRate   = 44100;
+    std::uint16_t bufferFrames = 1024;  // Should be a power of 2.
+    // If set, the device may use a different sample rate to the one requested.
+    bool          allowSampleRateChange = true;
+    // The most channels mixed at once (0 for no limit), this bounds the time the callback takes.
+    std::uint32_t maxVoices     = 64;
+    VoiceStealing voiceStealing = VoiceStealing::Oldest;
+    // If set, creating a sound from the same file (or the same WavHelper data) with the same
+    // SampleStorage returns the existing sound while it is still in use, rather than loading and
+    // converting it again. Files are matched by path, so changes to a file won't be seen.
+    bool          cacheSounds   = false;
+    // If not empty, converted sounds are also saved in this (existing) directory, so later runs
+    // can skip the conversion to the device sample rate.
+    std::string   diskCacheDirectory;
+    // No audio device is opened, instead the output is produced by calling Audio::Render() (as fast
+    // as the CPU allows). The output is 16 bit stereo at sampleRate, used for tests and benchmarks.
+    bool          offline       = false;
+    // The SDL_AudioFormat of the offline output (e.g. AUDIO_F32SYS), 0 for 16 bit (AUDIO_S16SYS).
+    std::uint16_t offlineFormat = 0;
+
+    // About 23ms of latency.
+    static AudioSettings Default() { return AudioSettings(); }
+    // About 5ms of latency.
+    static AudioSettings LowLatency() { return AudioSettings(48000, 256); }
+    // About 2.7ms of latency, only suitable if very few channels are playing at once.
+    static AudioSettings VeryLowLatency() { return AudioSettings(48000, 128); }
+
+    AudioSettings() = default;
+    AudioSettings(long sampleRate, std::uint16_t bufferFrames)
+        : sampleRate(sampleRate), bufferFrames(bufferFrames) {}
+};
+
+// Timing information gathered by the audio callback, used to tune the AudioSettings.
+class AudioStats
+{
+public:
+    // What the device actually uses (may differ from the requested settings).
+    long          sampleRate   = 0;
+    std::uint16_t bufferFrames = 0;
+
+    std::uint64_t callbacks = 0;
+    // The time available to fill one buffer, and the time the callback took.
+    double        budgetMicroseconds       = 0;
+    double        lastCallbackMicroseconds = 0;
+    double        maxCallbackMicroseconds  = 0;
+    double        meanCallbackMicroseconds = 0;
+    // Callbacks which took longer than the budget (including waiting for the mutex). The device
+    // queues more than one buffer, so these risk an underrun rather than always causing one.
+    std::uint64_t overBudgetCallbacks = 0;
+    // Playing channels that were stopped to keep within AudioSettings::maxVoices.
+    std::uint64_t voicesStolen = 0;
+    // Frames of streaming sounds that weren't read from the file in time (output as silence).
+    std::uint64_t streamUnderrunFrames = 0;
+    // Frames of prerendered buses that weren't ready in time (output as silence).
+    std::uint64_t prerenderUnderrunFrames = 0;
+};
+
+} // End of namespace mi.
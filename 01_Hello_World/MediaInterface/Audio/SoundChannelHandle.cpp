@@ -3,24 +3,31 @@
 #include <stdexcept>
 #include <mutex>
 #include <cstdint>
+#include <algorithm>
 
 using error = std::runtime_error;
 using std::mutex;
 using std::lock_guard;
 using std::uint32_t;
+using std::uint64_t;
 
 namespace mi
 {
 
 SoundChannelHandle::SoundChannelHandle() noexcept
 {
-    SetSoundChannel(nullptr, 0);
+    channelId = 0;
+    audio     = nullptr;
+    refCount  = nullptr;
     return;
 }
 
-SoundChannelHandle::SoundChannelHandle(Audio* audio, uint32_t channelId)
+SoundChannelHandle::SoundChannelHandle(Audio* audio, uint32_t channelId,
+                                       std::atomic<uint32_t>* refCount)
 {
-    SetSoundChannel(audio, channelId);
+    this->channelId = channelId;
+    this->audio     = audio;
+    this->refCount  = refCount;
     return;
 }
 
@@ -39,9 +46,10 @@ SoundChannelHandle::SoundChannelHandle(const SoundChannelHandle& channel) noexce
 {
     channelId = channel.channelId;
     audio     = channel.audio;
+    refCount  = channel.refCount;
 
-    if (audio)
-        audio->IncSoundChannelRefCount(channelId);
+    if (refCount)
+        Audio::AddRef(refCount);
 
     return;
 }
@@ -50,9 +58,11 @@ SoundChannelHandle::SoundChannelHandle(SoundChannelHandle&& channel) noexcept
 {
     channelId = channel.channelId;
     audio     = channel.audio;
+    refCount  = channel.refCount;
 
     channel.channelId = 0;
     channel.audio     = nullptr;
+    channel.refCount  = nullptr;
 
     return;
 }
@@ -66,9 +76,10 @@ SoundChannelHandle& SoundChannelHandle::operator=(const SoundChannelHandle& chan
 
     channelId = channel.channelId;
     audio     = channel.audio;
+    refCount  = channel.refCount;
 
-    if (audio)
-        audio->IncSoundChannelRefCount(channelId);
+    if (refCount)
+        Audio::AddRef(refCount);
 
     return *this;
 }
@@ -82,9 +93,11 @@ SoundChannelHandle& SoundChannelHandle::operator=(SoundChannelHandle&& channel)
 
     channelId = channel.channelId;
     audio     = channel.audio;
+    refCount  = channel.refCount;
 
     channel.channelId = 0;
     channel.audio     = nullptr;
+    channel.refCount  = nullptr;
 
     return *this;
 }
@@ -97,30 +110,14 @@ bool SoundChannelHandle::operator==(const SoundChannelHandle& rhs) const noexcep
     return audio==rhs.audio && channelId==rhs.channelId;
 }
 
-void SoundChannelHandle::SetSoundChannel(Audio* audio, uint32_t channelId)
-{
-    if(!audio)
-    {
-        this->channelId = 0;
-        this->audio     = nullptr;
-    }
-    else
-    {        
-        this->audio     = audio;
-        this->channelId = channelId;
-        audio->IncSoundChannelRefCount(channelId);
-    }
-
-    return;
-}
-
 void SoundChannelHandle::Free()
 {
-    if (audio)
-        audio->DecSoundChannelRefCount(channelId);
+    if (refCount)
+        audio->Release(refCount);
 
     channelId = 0;
     audio     = nullptr;
+    refCount  = nullptr;
     return;
 }
 
@@ -129,47 +126,47 @@ void SoundChannelHandle::Load(const SoundHandle& sound,
                               double volume,
                               uint32_t sampleIndex)
 {
-    std::uint32_t newSound = 0;
-    std::uint32_t oldSound = 0;
+    lock_guard<mutex> lock(audio->audioMutex);
 
-    SoundEndRule oldSoundEndRule;
-    SoundEndRule newSoundEndRule;
+    auto it = audio->channels.find(channelId);
+    if (it == audio->channels.end() || it->second == nullptr)
+        throw error("Trying to load a sound into an invalid channel");
 
-    {
-        lock_guard<mutex> lock(audio->audioMutex);
-
-        auto it = audio->channels.find(channelId);
-        if (it == audio->channels.end() || it->second == nullptr)
-            throw error("Trying to load a sound into an invalid channel");
-
-        if (audio->sounds.find(sound.soundId) == audio->sounds.end() && sound.soundId != 0)
-            throw error("Trying to load an invalid sound into a channel");
-
-        it->second->soundState   = SoundState::Stopped;
-        it->second->volume       = volume;
-        it->second->sampleIndex  = sampleIndex;
-
-        oldSoundEndRule = it->second->soundEndRule; 
-        newSoundEndRule = soundEndRule;
-        it->second->soundEndRule = newSoundEndRule;
-        
-        oldSound = it->second->soundId;
-        newSound = sound.soundId;
-        it->second->soundId = newSound;
-    }
+    if (audio->sounds.find(sound.soundId) == audio->sounds.end() && sound.soundId != 0)
+        throw error("Trying to load an invalid sound into a channel");
+
+    Audio::Channel* pC = it->second.get();
+
+    pC->soundState   = SoundState::Stopped;
+    pC->volume       = volume;
+    pC->sampleIndex  = sampleIndex;
+    pC->startTime    = Audio::noTime;
+    pC->stopTime     = Audio::noTime;
+    // A new sound starts at the volume given rather than ramping to it.
+    pC->TargetGains(pC->gainLeft, pC->gainRight);
 
-    if (newSound != oldSound)
+    SoundEndRule oldSoundEndRule = pC->soundEndRule;
+    pC->soundEndRule = soundEndRule;
+
+    // The channel holds a reference to its sound.
+    std::uint32_t oldSound = pC->soundId;
+    pC->soundId = sound.soundId;
+
+    if (sound.soundId != oldSound)
     {
-        audio->IncSoundRefCount(newSound);
-        audio->DecSoundRefCount(oldSound);
+        if (sound.soundId != 0)
+            Audio::AddRef(&audio->sounds[sound.soundId]->refCount);
+
+        if (oldSound != 0)
+            audio->Release(&audio->sounds[oldSound]->refCount);
     }
 
     // If the sound end rule is StopAndDeleteChannel we want the audio object to take ownership.
-    if (newSoundEndRule == SoundEndRule::StopAndDeleteChannel)
-        audio->IncSoundChannelRefCount(channelId);
+    if (soundEndRule == SoundEndRule::StopAndDeleteChannel)
+        Audio::AddRef(&pC->refCount);
 
     if (oldSoundEndRule == SoundEndRule::StopAndDeleteChannel)
-        audio->DecSoundChannelRefCount(channelId);
+        audio->Release(&pC->refCount);
 
     return;
 }
@@ -197,6 +194,9 @@ void SoundChannelHandle::Play()
         throw error("Trying to play an invalid sound");
 
     it->second->soundState = SoundState::Playing;
+    it->second->playTime   = audio->clock;
+    it->second->startTime  = Audio::noTime;
+    it->second->stopTime   = Audio::noTime;
 
     return;
 }
@@ -210,6 +210,8 @@ void SoundChannelHandle::Pause()
         throw error("Trying to pause audio on an invalid channel");
 
     it->second->soundState = SoundState::Stopped;
+    it->second->startTime  = Audio::noTime;
+    it->second->stopTime   = Audio::noTime;
 
     return;
 }
@@ -224,6 +226,90 @@ void SoundChannelHandle::Stop()
 
     it->second->soundState  = SoundState::Stopped;
     it->second->sampleIndex = 0;
+    it->second->startTime   = Audio::noTime;
+    it->second->stopTime    = Audio::noTime;
+
+    return;
+}
+
+void SoundChannelHandle::SetVolume(double volume)
+{
+    lock_guard<mutex> lock(audio->audioMutex);
+
+    auto it = audio->channels.find(channelId);
+    if (it == audio->channels.end() || it->second == nullptr)
+        throw error("Trying to set the volume of an invalid channel");
+
+    it->second->volume = volume;
+
+    return;
+}
+
+void SoundChannelHandle::SetPan(double pan)
+{
+    lock_guard<mutex> lock(audio->audioMutex);
+
+    auto it = audio->channels.find(channelId);
+    if (it == audio->channels.end() || it->second == nullptr)
+        throw error("Trying to set the pan of an invalid channel");
+
+    it->second->pan = std::clamp(pan, -1.0, 1.0);
+
+    return;
+}
+
+void SoundChannelHandle::PlayAt(uint64_t clockTime)
+{
+    lock_guard<mutex> lock(audio->audioMutex);
+
+    auto it = audio->channels.find(channelId);
+    if (it == audio->channels.end() || it->second == nullptr)
+        throw error("Trying to play audio on an invalid channel");
+
+    std::uint32_t soundId = it->second->soundId;
+    if (soundId==0 || audio->sounds.find(soundId)==audio->sounds.end())
+        throw error("Trying to play an invalid sound");
+
+    it->second->startTime = clockTime;
+
+    return;
+}
+
+void SoundChannelHandle::StopAt(uint64_t clockTime)
+{
+    lock_guard<mutex> lock(audio->audioMutex);
+
+    auto it = audio->channels.find(channelId);
+    if (it == audio->channels.end() || it->second == nullptr)
+        throw error("Trying to stop audio on an invalid channel");
+
+    it->second->stopTime = clockTime;
+
+    return;
+}
+
+void SoundChannelHandle::SetBus(AudioBus bus)
+{
+    lock_guard<mutex> lock(audio->audioMutex);
+
+    auto it = audio->channels.find(channelId);
+    if (it == audio->channels.end() || it->second == nullptr)
+        throw error("Trying to set the bus of an invalid channel");
+
+    it->second->bus = bus;
+
+    return;
+}
+
+void SoundChannelHandle::SetPriority(int priority)
+{
+    lock_guard<mutex> lock(audio->audioMutex);
+
+    auto it = audio->channels.find(channelId);
+    if (it == audio->channels.end() || it->second == nullptr)
+        throw error("Trying to set the priority of an invalid channel");
+
+    it->second->priority = priority;
 
     return;
 }
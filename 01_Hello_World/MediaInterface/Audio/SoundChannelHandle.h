@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <atomic>
 
 namespace mi
 {
@@ -22,6 +23,16 @@ enum class SoundEndRule: std::uint8_t
     StopAndDeleteChannel
 };
 
+// Channels are mixed into a bus, each of which has its own gain and effects before being mixed
+// into the Master bus (see MediaInterface::SetBusGain()).
+enum class AudioBus: std::uint8_t
+{
+    Effects,
+    Music,
+    Interface,
+    Master
+};
+
 class SoundChannelHandle
 {
 public:
@@ -53,17 +64,39 @@ public:
     void Pause();
     void Stop();
 
+    // Changes are smoothed over the next mixed block, so can be made every frame without clicks.
+    void SetVolume(double volume);
+    // -1 is fully left, 0 centre, and 1 fully right.
+    void SetPan(double pan);
+
+    // Schedule the channel to start playing or stop (as in Stop()) at the given audio clock time
+    // (see MediaInterface::GetAudioClock()), accurate to the frame. Times in the past take effect
+    // immediately. A channel already playing restarts its sound from the beginning at the start
+    // time. Calling Load(), Play(), Pause() or Stop() cancels the schedule, as does the sound
+    // ending or the channel being stopped to keep within AudioSettings::maxVoices.
+    void PlayAt(std::uint64_t clockTime);
+    void StopAt(std::uint64_t clockTime);
+
+    // Channels start on the AudioBus::Effects bus.
+    void SetBus(AudioBus bus);
+
+    // When more channels are playing than AudioSettings::maxVoices allows, the lowest priority
+    // channels are stopped first (the default priority is 0).
+    void SetPriority(int priority);
+
     void GetState(SoundState& state, std::uint32_t& sampleIndex);
     bool IsPlaying();
 
 private:
-    SoundChannelHandle(Audio* audio, std::uint32_t channelId);
+    // Takes ownership of one reference (which the caller has already added).
+    SoundChannelHandle(Audio* audio, std::uint32_t channelId,
+                       std::atomic<std::uint32_t>* refCount);
 
-    void SetSoundChannel(Audio* audio, std::uint32_t channelId);
     void Free();
 
-    std::uint32_t channelId;
-    Audio* audio;
+    std::uint32_t               channelId;
+    Audio*                      audio;
+    std::atomic<std::uint32_t>* refCount;
 
     friend class Audio;
 };
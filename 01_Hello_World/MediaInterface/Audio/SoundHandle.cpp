@@ -9,13 +9,17 @@ namespace mi
 
 SoundHandle::SoundHandle() noexcept
 {
-    SetSound(nullptr, 0);
+    soundId  = 0;
+    audio    = nullptr;
+    refCount = nullptr;
     return;
 }
 
-SoundHandle::SoundHandle(Audio* audio, uint32_t soundId)
+SoundHandle::SoundHandle(Audio* audio, uint32_t soundId, std::atomic<uint32_t>* refCount)
 {
-    SetSound(audio, soundId);
+    this->soundId  = soundId;
+    this->audio    = audio;
+    this->refCount = refCount;
     return;
 }
 
@@ -32,22 +36,25 @@ SoundHandle::~SoundHandle()
 
 SoundHandle::SoundHandle(const SoundHandle& snd) noexcept
 {
-    soundId = snd.soundId;
-    audio   = snd.audio;
+    soundId  = snd.soundId;
+    audio    = snd.audio;
+    refCount = snd.refCount;
 
-    if (audio)
-        audio->IncSoundRefCount(soundId);
+    if (refCount)
+        Audio::AddRef(refCount);
 
     return;
 }
 
 SoundHandle::SoundHandle(SoundHandle&& snd) noexcept
 {
-    soundId = snd.soundId;
-    audio   = snd.audio;
+    soundId  = snd.soundId;
+    audio    = snd.audio;
+    refCount = snd.refCount;
 
-    snd.soundId = 0;
-    snd.audio   = nullptr;
+    snd.soundId  = 0;
+    snd.audio    = nullptr;
+    snd.refCount = nullptr;
 
     return;
 }
@@ -59,11 +66,12 @@ SoundHandle& SoundHandle::operator=(const SoundHandle& snd) noexcept
 
     Free();
 
-    soundId = snd.soundId;
-    audio   = snd.audio;
-    
-    if (audio)
-        audio->IncSoundRefCount(soundId);
+    soundId  = snd.soundId;
+    audio    = snd.audio;
+    refCount = snd.refCount;
+
+    if (refCount)
+        Audio::AddRef(refCount);
 
     return *this;
 }
@@ -75,11 +83,13 @@ SoundHandle& SoundHandle::operator=(SoundHandle&& snd) noexcept
 
     Free();
 
-    soundId = snd.soundId;
-    audio   = snd.audio;
+    soundId  = snd.soundId;
+    audio    = snd.audio;
+    refCount = snd.refCount;
 
-    snd.soundId = 0;
-    snd.audio   = nullptr;
+    snd.soundId  = 0;
+    snd.audio    = nullptr;
+    snd.refCount = nullptr;
 
     return *this;
 }
@@ -92,30 +102,14 @@ bool SoundHandle::operator==(const SoundHandle& rhs) const noexcept
     return audio==rhs.audio && soundId==rhs.soundId;
 }
 
-void SoundHandle::SetSound(Audio* audio, uint32_t soundId)
-{
-    if(!audio || soundId==0)
-    {
-        this->soundId = 0;
-        this->audio   = nullptr;
-    }
-    else
-    {        
-        this->soundId = soundId;
-        this->audio   = audio;
-        audio->IncSoundRefCount(soundId);
-    }
-
-    return;
-}
-
 void SoundHandle::Free()
 {
-    if (audio)
-        audio->DecSoundRefCount(soundId);
+    if (refCount)
+        audio->Release(refCount);
 
-    soundId = 0;
-    audio   = nullptr;
+    soundId  = 0;
+    audio    = nullptr;
+    refCount = nullptr;
     return;
 }
 
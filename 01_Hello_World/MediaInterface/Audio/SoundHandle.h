@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <atomic>
 
 namespace mi
 {
@@ -9,6 +10,17 @@ namespace mi
 class Audio;
 class SoundChannelHandle;
 
+// How the samples of a (non streaming) sound are stored in memory.
+// Int16 halves the memory used, at the cost of some precision when resampling.
+// Adpcm (IMA ADPCM) uses about an eighth of the memory of Float, at the cost of some noise and
+// decoding the samples each time they are mixed.
+enum class SampleStorage: std::uint8_t
+{
+    Float,
+    Int16,
+    Adpcm
+};
+
 class SoundHandle
 {
 public:
@@ -25,13 +37,14 @@ public:
     bool operator!=(const SoundHandle& rhs) const noexcept { return !(*this == rhs); }
 
 private:
-    SoundHandle(Audio* audio, std::uint32_t soundId);
+    // Takes ownership of one reference (which the caller has already added).
+    SoundHandle(Audio* audio, std::uint32_t soundId, std::atomic<std::uint32_t>* refCount);
 
-    void SetSound(Audio* audio, std::uint32_t soundId);
     void Free();
 
-    std::uint32_t soundId;
-    Audio*        audio;
+    std::uint32_t               soundId;
+    Audio*                      audio;
+    std::atomic<std::uint32_t>* refCount;
 
     friend class Audio;
     friend class SoundChannelHandle;
@@ -0,0 +1,255 @@
+#include "SoundStream.h"
+#include <stdexcept>
+#include <string>
+#include <cstdint>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cmath>
+#include <algorithm>
+
+using error = std::runtime_error;
+using std::string;
+using std::uint8_t;
+using std::int16_t;
+using std::uint32_t;
+using std::uint64_t;
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+
+namespace mi
+{
+
+SoundStream::SoundStream(const string& filename, unsigned long targetSampleRate)
+    : writeCount{0}, readCount{0}, requestFrame{0}, requestGeneration{0},
+      discardCount{0}, ackGeneration{0}, quit{false}, failed{false}
+{
+    file.open(filename, std::ios::binary);
+    if (file.good() == false)
+        throw error("SoundStream() : Could not open file.");
+
+    WavHelper::ReadHeader(file, header);
+    dataStart   = file.tellg();
+    inputFrames = header.dataSize/header.blockAlign;
+
+    if (inputFrames <= 1)
+        throw error("SoundStream() : Not enough samples.");
+
+    // Use the same number of frames as Audio::Convert() would produce.
+    double totalSamples = (inputFrames-1)
+                          *static_cast<double>(targetSampleRate)/header.sampleRate
+                          +1;
+
+    if (totalSamples >= 4294967295.0)
+        throw error("SoundStream() : Too many samples.");
+
+    this->targetSampleRate = targetSampleRate;
+    numFrames = static_cast<uint32_t>(std::ceil(totalSamples));
+
+    windowStart = 0;
+    inLeft.reserve(chunkFrames+2);
+    inRight.reserve(chunkFrames+2);
+    readBuffer.resize(std::size_t(header.blockAlign)*chunkFrames);
+    decoded.resize(chunkFrames);
+    ring.resize(std::size_t(2)*ringFrames);
+
+    nextFrame         = 0;
+    generation        = 0;
+    readFrame         = 0;
+    pendingGeneration = 0;
+    seeking           = false;
+
+    // Have the start ready so playback can begin straight away.
+    Fill(chunkFrames);
+
+    worker = std::thread(&SoundStream::Run, this);
+    return;
+}
+
+SoundStream::~SoundStream()
+{
+    quit = true;
+
+    if (worker.joinable())
+        worker.join();
+}
+
+bool SoundStream::GetFrame(uint32_t index, float& left, float& right)
+{
+    left  = 0;
+    right = 0;
+
+    if (failed.load(memory_order_relaxed) || index >= numFrames)
+        return false;
+
+    if (seeking)
+    {
+        if (ackGeneration.load(memory_order_acquire) != pendingGeneration)
+            return false; // Still waiting for the worker to handle the seek.
+
+        // Skip the frames written before the seek.
+        readCount.store(discardCount.load(memory_order_relaxed), memory_order_release);
+        readFrame = requestFrame.load(memory_order_relaxed);
+        seeking   = false;
+    }
+
+    uint64_t read      = readCount.load(memory_order_relaxed);
+    uint64_t available = writeCount.load(memory_order_acquire)-read;
+    uint32_t distance  = (index >= readFrame) ? index-readFrame : index+(numFrames-readFrame);
+
+    if (distance >= available)
+    {
+        // If the frame is too far ahead wait for the worker to catch up, otherwise seek.
+        if (distance >= ringFrames)
+        {
+            pendingGeneration++;
+            requestFrame.store(index, memory_order_relaxed);
+            requestGeneration.store(pendingGeneration, memory_order_release);
+            seeking = true;
+        }
+        return false;
+    }
+
+    read += distance;
+    std::size_t pos = static_cast<std::size_t>(read & (ringFrames-1));
+    left  = ring[2*pos];
+    right = ring[2*pos+1];
+
+    readCount.store(read+1, memory_order_release);
+    readFrame = (index+1 == numFrames) ? 0 : index+1;
+    return true;
+}
+
+void SoundStream::Run()
+{
+    try
+    {
+        while (!quit.load(memory_order_relaxed))
+        {
+            // Handle any seek request.
+            uint32_t g = requestGeneration.load(memory_order_acquire);
+            if (g != generation)
+            {
+                generation = g;
+                nextFrame  = requestFrame.load(memory_order_relaxed);
+                discardCount.store(writeCount.load(memory_order_relaxed), memory_order_relaxed);
+                ackGeneration.store(g, memory_order_release);
+            }
+
+            if (Fill(1024) == 0)
+                std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+    catch(...)
+    {
+        // We can't let exceptions escape, as this function is being called in a thread.
+        failed = true;
+    }
+
+    return;
+}
+
+uint32_t SoundStream::Fill(uint32_t maxFrames)
+{
+    uint64_t written = writeCount.load(memory_order_relaxed);
+    uint64_t space   = ringFrames-(written-readCount.load(memory_order_acquire));
+    uint32_t count   = static_cast<uint32_t>(std::min<uint64_t>(space, maxFrames));
+
+    double ratio = static_cast<double>(header.sampleRate)/targetSampleRate;
+
+    for (uint32_t n=0; n<count; n++)
+    {
+        // Linearly interpolate between input frames (the same as Audio::Convert()).
+        double   index  = nextFrame*ratio;
+        uint64_t lower  = static_cast<uint64_t>(index);
+        uint64_t upper  = lower+1;
+        double   factor = index-lower;
+
+        if (lower >= inputFrames)
+            lower = inputFrames-1;
+
+        if (upper >= inputFrames)
+            upper = inputFrames-1;
+
+        ReadInput(lower, upper);
+        lower -= windowStart;
+        upper -= windowStart;
+
+        std::size_t pos = static_cast<std::size_t>((written+n) & (ringFrames-1));
+        ring[2*pos]   = static_cast<float>(inLeft[lower]*(1-factor)  + inLeft[upper]*factor);
+        ring[2*pos+1] = static_cast<float>(inRight[lower]*(1-factor) + inRight[upper]*factor);
+
+        // Wrap around, so looping doesn't need a seek.
+        nextFrame++;
+        if (nextFrame == numFrames)
+            nextFrame = 0;
+    }
+
+    writeCount.store(written+count, memory_order_release);
+    return count;
+}
+
+void SoundStream::SeekInput(uint64_t frame)
+{
+    file.clear();
+    file.seekg(dataStart + static_cast<std::streamoff>(frame*header.blockAlign));
+
+    if (file.good() == false)
+        throw error("SoundStream() : Could not seek.");
+
+    windowStart = frame;
+    inLeft.clear();
+    inRight.clear();
+    return;
+}
+
+void SoundStream::ReadInput(uint64_t lower, uint64_t upper)
+{
+    uint64_t windowEnd = windowStart+inLeft.size();
+
+    if (lower >= windowStart && upper < windowEnd)
+        return; // Already have the frames.
+
+    if (lower < windowStart || lower > windowEnd)
+    {
+        SeekInput(lower);
+    }
+    else
+    {
+        // Drop the frames we no longer need.
+        std::size_t drop = static_cast<std::size_t>(lower-windowStart);
+        inLeft.erase(inLeft.begin(), inLeft.begin()+drop);
+        inRight.erase(inRight.begin(), inRight.begin()+drop);
+        windowStart = lower;
+    }
+
+    windowEnd = windowStart+inLeft.size();
+
+    // Read the next chunk (the file position is always at windowEnd).
+    std::size_t count = static_cast<std::size_t>(std::min<uint64_t>(chunkFrames,
+                                                                    inputFrames-windowEnd));
+
+    file.read(reinterpret_cast<char*>(readBuffer.data()),
+              static_cast<std::streamsize>(count*header.blockAlign));
+
+    if (file.gcount() != static_cast<std::streamsize>(count*header.blockAlign))
+        throw error("SoundStream() : Could not read samples.");
+
+    // Only consider the first two channels.
+    // If there is only one channel duplicate it to get two channels.
+    WavHelper::Deinterleave(header, readBuffer.data(), count, 0, decoded.data());
+    for (std::size_t i=0; i<count; i++)
+        inLeft.push_back(decoded[i]/32768.0f);
+
+    if (header.numChannels > 1)
+        WavHelper::Deinterleave(header, readBuffer.data(), count, 1, decoded.data());
+
+    for (std::size_t i=0; i<count; i++)
+        inRight.push_back(decoded[i]/32768.0f);
+
+    return;
+}
+
+} // End of namespace mi.
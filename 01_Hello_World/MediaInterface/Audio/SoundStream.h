@@ -0,0 +1,80 @@
+#pragma once
+
+#include "WavHelper.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <thread>
+#include <atomic>
+
+namespace mi
+{
+
+// Plays a wav file without loading it all into memory.
+// A background thread reads and converts chunks of the file into a ring buffer, which the audio
+// callback consumes. The stream wraps around at the end of the file so looping is seamless.
+// Frames are expected to be requested in order, requesting a frame out of order causes the stream
+// to seek (and output silence until the new data arrives). So only play a streaming sound on one
+// channel at a time.
+class SoundStream
+{
+public:
+    SoundStream(const std::string& filename, unsigned long targetSampleRate);
+    ~SoundStream();
+
+    SoundStream(const SoundStream&) = delete;
+    SoundStream& operator=(const SoundStream&) = delete;
+
+    // The number of frames once converted to the target sample rate.
+    std::uint32_t Size() const noexcept { return numFrames; }
+
+    // Should only be called by the audio callback.
+    // Returns false (and sets left and right to 0) if the frame isn't ready yet.
+    bool GetFrame(std::uint32_t index, float& left, float& right);
+
+private:
+    static const std::uint32_t ringFrames  = 1 << 15; // Must be a power of 2.
+    static const std::uint32_t chunkFrames = 4096;    // Input frames read from the file at once.
+
+    void Run();
+    // Returns the number of frames written.
+    std::uint32_t Fill(std::uint32_t maxFrames);
+    void SeekInput(std::uint64_t frame);
+    void ReadInput(std::uint64_t lower, std::uint64_t upper);
+
+    // Worker thread data.
+    std::ifstream             file;
+    WavHelper::Header         header;
+    std::streampos            dataStart;
+    std::uint64_t             inputFrames;
+    std::uint64_t             windowStart; // Input frame held in inLeft[0] and inRight[0].
+    std::vector<float>        inLeft;
+    std::vector<float>        inRight;
+    std::vector<std::uint8_t> readBuffer;
+    std::vector<std::int16_t> decoded;
+    std::uint32_t             nextFrame;   // Next frame to be written to the ring buffer.
+    std::uint32_t             generation;  // Last seek request handled.
+    unsigned long             targetSampleRate;
+    std::uint32_t             numFrames;
+
+    // Audio callback data.
+    std::uint32_t readFrame;         // Frame stored at readCount.
+    std::uint32_t pendingGeneration; // Last seek request made.
+    bool          seeking;
+
+    // Shared data.
+    std::vector<float>         ring; // Interleaved left, right.
+    std::atomic<std::uint64_t> writeCount;
+    std::atomic<std::uint64_t> readCount;
+    std::atomic<std::uint32_t> requestFrame;
+    std::atomic<std::uint32_t> requestGeneration;
+    std::atomic<std::uint64_t> discardCount;
+    std::atomic<std::uint32_t> ackGeneration;
+    std::atomic<bool>          quit;
+    std::atomic<bool>          failed;
+
+    std::thread worker;
+};
+
+} // End of namespace mi.
@@ -3,6 +3,9 @@
 #include <iostream>
 #include <fstream>
 #include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
 
 using error = std::runtime_error;
 using std::istream;
@@ -11,6 +14,8 @@ using std::ifstream;
 using std::ofstream;
 using std::vector;
 using std::string;
+using std::uint8_t;
+using std::int16_t;
 using std::uint32_t;
 
 namespace
@@ -31,6 +36,83 @@ void WriteUnsignedInt(ostream& out, long bytes, uint32_t value)
     return;
 }
 
+// Conversion routines from little endian 8 bit Unsigned, 16/24/32 bit Signed, and 32 bit Float
+// samples to 16 bit.
+int16_t UI8To16(const uint8_t* p)
+{
+    return static_cast<int16_t>((p[0]-128) * 256);
+}
+
+int16_t SI16To16(const uint8_t* p)
+{
+    return static_cast<int16_t>(p[0] | p[1]<<8);
+}
+
+int16_t SI24To16(const uint8_t* p)
+{
+    return static_cast<int16_t>(p[1] | p[2]<<8);
+}
+
+int16_t SI32To16(const uint8_t* p)
+{
+    return static_cast<int16_t>(p[2] | p[3]<<8);
+}
+
+int16_t FloatTo16(const uint8_t* p)
+{
+    uint32_t bits = p[0] | p[1]<<8 | p[2]<<16 | static_cast<uint32_t>(p[3])<<24;
+    float    value;
+    std::memcpy(&value, &bits, sizeof(value));
+
+    // Corrupt data may hold NaNs, which can't be converted to an integer.
+    if (std::isnan(value))
+        return 0;
+
+    value = std::round(value*32768.0f);
+    return static_cast<int16_t>(std::clamp(value, -32768.0f, 32767.0f));
+}
+
+// Kept as a template so the conversion is inlined into the loop.
+template<typename Convert>
+void ConvertChannel(const uint8_t* data, std::size_t stride, std::size_t numFrames,
+                    int16_t* output, Convert convert)
+{
+    for (std::size_t n=0; n<numFrames; n++)
+        output[n] = convert(data + n*stride);
+    return;
+}
+
+// Conversion routines from 16 bit samples to little endian 16 bit Signed and 32 bit Float.
+void SI16ToSI16(int16_t value, uint8_t* p)
+{
+    p[0] = static_cast<uint8_t>(value & 0xff);
+    p[1] = static_cast<uint8_t>((value >> 8) & 0xff);
+    return;
+}
+
+void SI16ToFloat(int16_t value, uint8_t* p)
+{
+    float    f = value/32768.0f;
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+
+    p[0] = static_cast<uint8_t>(bits & 0xff);
+    p[1] = static_cast<uint8_t>((bits >> 8)  & 0xff);
+    p[2] = static_cast<uint8_t>((bits >> 16) & 0xff);
+    p[3] = static_cast<uint8_t>((bits >> 24) & 0xff);
+    return;
+}
+
+// Kept as a template so the conversion is inlined into the loop.
+template<typename Convert>
+void InterleaveChannel(const int16_t* input, std::size_t numFrames,
+                       uint8_t* data, std::size_t stride, Convert convert)
+{
+    for (std::size_t n=0; n<numFrames; n++)
+        convert(input[n], data + n*stride);
+    return;
+}
+
 } // End of namespace.
 
 namespace mi
@@ -38,63 +120,163 @@ namespace mi
 
 void WavHelper::Load(const string& filename)
 {
-    ifstream       file;
-    unsigned short numChannels;
-    unsigned long  dataSize;
+    ifstream file;
+    Header   header;
 
     file.open(filename, std::ios::binary);
     if (file.good() == false)
         throw error("WavHelper.Load() : Could not open file.");
 
-    if (ReadUnsignedInt(file,4) != 0x46464952UL) // "RIFF" in ASCII
-        throw error("WavHelper.Load() : Expected to read chunk id 'RIFF'.");
-    
-    ReadUnsignedInt(file, 4); // File size - 8 (For "RIFF", and the Unsigned Int just read).
+    ReadHeader(file, header);
 
-    if (ReadUnsignedInt(file,4) != 0x45564157UL) // "WAVE" in ASCII
-        throw error("WavHelper.Load() : Format is not 'WAVE'.");
+    sampleRate = header.sampleRate;
 
-    if (ReadUnsignedInt(file,4) != 0x20746d66UL) // "fmt " in ASCII
-        throw error("WavHelper.Load() : Subchunk1 ID is not 'fmt '.");
+    std::size_t numFrames = header.dataSize/header.blockAlign;
 
-    if (ReadUnsignedInt(file,4) != 16) // Format description is 16 bytes for PCM.
-        throw error("WavHelper.Load() : Unexpected format size for a PCM Wav file.");
+    // Allocate all the memory up front.
+    amplitudes.resize(header.numChannels);
+    for (long i=0; i<header.numChannels; i++)
+        amplitudes[i].resize(numFrames);
 
-    if (ReadUnsignedInt(file,2) != 1) // Audio format = 1 (PCM).
-        throw error("WavHelper.Load() : Audio format is not PCM.");
+    // Read the data in large blocks, and split it into the channels.
+    const std::size_t blockFrames = (std::size_t(1) << 16);
+    vector<uint8_t>   buffer(std::min(numFrames, blockFrames)*header.blockAlign);
 
-    numChannels = ReadUnsignedInt(file,2);
-    
-    if (numChannels == 0)
-        throw error("WavHelper.Load() : The number of channels is 0.");
+    for (std::size_t frame=0; frame<numFrames; frame+=blockFrames)
+    {
+        std::size_t count = std::min(numFrames-frame, blockFrames);
+
+        file.read(reinterpret_cast<char*>(buffer.data()),
+                  static_cast<std::streamsize>(count*header.blockAlign));
+
+        if (file.gcount() != static_cast<std::streamsize>(count*header.blockAlign))
+            throw error("WavHelper.Load() : The file ended before the end of the data.");
+
+        for (long i=0; i<header.numChannels; i++)
+            Deinterleave(header, buffer.data(), count, i, amplitudes[i].data()+frame);
+    }
+
+    file.close();
+    return;
+}
 
-    sampleRate = ReadUnsignedInt(file,4);
+void WavHelper::ReadHeader(istream& file, Header& header)
+{
+    if (ReadUnsignedInt(file,4) != 0x46464952UL) // "RIFF" in ASCII
+        throw error("WavHelper.Load() : Expected to read chunk id 'RIFF'.");
     
-    ReadUnsignedInt(file, 4); // Byte rate.
-    ReadUnsignedInt(file, 2); // Block align.
+    ReadUnsignedInt(file, 4); // File size - 8 (For "RIFF", and the Unsigned Int just read).
 
-    if (ReadUnsignedInt(file,2) != 16) // Bits per sample.
-        throw error("WavHelper.Load() : Only 16 bit samples are currently supported.");
+    if (ReadUnsignedInt(file,4) != 0x45564157UL) // "WAVE" in ASCII
+        throw error("WavHelper.Load() : Format is not 'WAVE'.");
 
-    if (ReadUnsignedInt(file,4) != 0x61746164UL) // "data" in ASCII
-        throw error("WavHelper.Load() : Subchunk2 ID is not 'data'.");
+    bool foundFormat = false;
+
+    // Walk through the chunks until we find the data.
+    while (true)
+    {
+        uint32_t chunkId   = ReadUnsignedInt(file,4);
+        uint32_t chunkSize = ReadUnsignedInt(file,4);
+
+        if (file.good() == false)
+            throw error("WavHelper.Load() : Could not find the 'data' chunk.");
+
+        if (chunkId == 0x20746d66UL) // "fmt " in ASCII
+        {
+            if (chunkSize < 16)
+                throw error("WavHelper.Load() : Format chunk is too small.");
+
+            uint32_t audioFormat = ReadUnsignedInt(file,2);
+            header.numChannels   = ReadUnsignedInt(file,2);
+            header.sampleRate    = ReadUnsignedInt(file,4);
+            ReadUnsignedInt(file, 4); // Byte rate.
+            header.blockAlign    = ReadUnsignedInt(file,2);
+            header.bitsPerSample = ReadUnsignedInt(file,2);
+            chunkSize -= 16;
+
+            // WAVE_FORMAT_EXTENSIBLE stores the actual format in the sub format.
+            if (audioFormat == 0xfffe && chunkSize >= 10)
+            {
+                ReadUnsignedInt(file, 2); // Size of the extension.
+                ReadUnsignedInt(file, 2); // Valid bits per sample.
+                ReadUnsignedInt(file, 4); // Channel mask.
+                audioFormat = ReadUnsignedInt(file,2);
+                chunkSize -= 10;
+            }
+
+            if (audioFormat != 1 && audioFormat != 3) // PCM or IEEE float.
+                throw error("WavHelper.Load() : Audio format is not PCM.");
+
+            header.isFloat = (audioFormat == 3);
+
+            if (header.numChannels == 0)
+                throw error("WavHelper.Load() : The number of channels is 0.");
+
+            if (header.isFloat ? header.bitsPerSample != 32
+                               : (header.bitsPerSample%8 != 0 || header.bitsPerSample > 32
+                                  || header.bitsPerSample == 0))
+                throw error("WavHelper.Load() : Unsupported bits per sample.");
+
+            if (header.blockAlign < header.numChannels*header.bitsPerSample/8)
+                throw error("WavHelper.Load() : Block align is too small.");
+
+            foundFormat = true;
+        }
+        else
+        if (chunkId == 0x61746164UL) // "data" in ASCII
+        {
+            if (!foundFormat)
+                throw error("WavHelper.Load() : Expected the 'fmt ' chunk before 'data'.");
+
+            // Streamed or truncated files may claim more data than they hold, so limit it to
+            // the rest of the file (before anything is allocated for it).
+            std::streampos dataStart = file.tellg();
+            file.seekg(0, std::ios::end);
+            std::streamoff remaining = file.tellg()-dataStart;
+            file.seekg(dataStart);
+
+            header.dataSize = static_cast<unsigned long>(
+                std::clamp<std::streamoff>(remaining, 0, chunkSize));
+            break;
+        }
+
+        // Skip the rest of the chunk (chunks are padded to an even size).
+        file.seekg(chunkSize + (chunkSize&1), std::ios::cur);
+    }
 
-    dataSize = ReadUnsignedInt(file,4);
+    if (file.good() == false)
+        throw error("WavHelper.Load() : Could not read the header.");
 
-    // Read in channels.
-    amplitudes.resize(numChannels);
-    for (long i=0; i<numChannels; i++)
-        amplitudes[i].resize(0);
+    return;
+}
 
-    for (size_t i=0; i<dataSize/2/numChannels; i++)
-    for (long j=0; j<numChannels; j++)
-        amplitudes[j].push_back(ReadUnsignedInt(file,2) | 0xffff0000);
+void WavHelper::Deinterleave(const Header& header, const uint8_t* data, std::size_t numFrames,
+                             std::size_t channel, int16_t* output)
+{
+    std::size_t stride = header.blockAlign;
+    data += channel*header.bitsPerSample/8;
+
+    if (header.isFloat)
+        ConvertChannel(data, stride, numFrames, output, FloatTo16);
+    else
+    if (header.bitsPerSample == 8)
+        ConvertChannel(data, stride, numFrames, output, UI8To16);
+    else
+    if (header.bitsPerSample == 16)
+        ConvertChannel(data, stride, numFrames, output, SI16To16);
+    else
+    if (header.bitsPerSample == 24)
+        ConvertChannel(data, stride, numFrames, output, SI24To16);
+    else
+    if (header.bitsPerSample == 32)
+        ConvertChannel(data, stride, numFrames, output, SI32To16);
+    else
+        throw error("WavHelper.Load() : Unsupported bits per sample.");
 
-    file.close();
     return;
 }
 
-void WavHelper::Save(const string& filename) const
+void WavHelper::Save(const string& filename, bool asFloat) const
 {
     ofstream file;
 
@@ -119,26 +301,62 @@ void WavHelper::Save(const string& filename) const
         throw error("WavHelper.Save() : Could not open file.");
 
     // Set the wav file header.
-    unsigned long dataSize = numSamples*numChannels*2; // NumSamples*NumChannels*BitsPerSample/8.
-
-    WriteUnsignedInt(file, 4, 0x46464952UL);             // "RIFF" in ASCII
-    WriteUnsignedInt(file, 4, dataSize+36);              // FileSize-8. (FileSize = DataSize+44)
-    WriteUnsignedInt(file, 4, 0x45564157UL);             // "WAVE" in ASCII
-    WriteUnsignedInt(file, 4, 0x20746d66UL);             // "fmt " in ASCII
-    WriteUnsignedInt(file, 4, 16);                       // Format description takes 16 bytes for PCM.
-    WriteUnsignedInt(file, 2, 1);                        // Audio Format is PCM (=1).
-    WriteUnsignedInt(file, 2, numChannels);              // NumChannels.
-    WriteUnsignedInt(file, 4, sampleRate);               // SampleRate.
-    WriteUnsignedInt(file, 4, sampleRate*numChannels*2); // ByteRate   = SampleRate*NumChannels*BitsPerSample/8.
-    WriteUnsignedInt(file, 2, numChannels*2);            // BlockAlign = NumChannels*BitsPerSample/8.
-    WriteUnsignedInt(file, 2, 16);                       // BitsPerSample.
-    WriteUnsignedInt(file, 4, 0x61746164UL);             // "data" in ASCII
-    WriteUnsignedInt(file, 4, dataSize);                 // DataSize.
-
-    // Write the amplitude data.
-    for (size_t j=0; j<amplitudes[0].size(); j++)
-    for (size_t i=0; i<amplitudes.size(); i++)
-        WriteUnsignedInt(file, 2, amplitudes[i][j]);
+    unsigned long bytesPerSample = asFloat ? 4 : 2;
+    unsigned long blockAlign     = numChannels*bytesPerSample;
+    unsigned long dataSize       = numSamples*blockAlign;
+
+    WriteUnsignedInt(file, 4, 0x46464952UL);            // "RIFF" in ASCII
+    if (asFloat)
+        WriteUnsignedInt(file, 4, dataSize+50);         // FileSize-8. (FileSize = DataSize+58)
+    else
+        WriteUnsignedInt(file, 4, dataSize+36);         // FileSize-8. (FileSize = DataSize+44)
+    WriteUnsignedInt(file, 4, 0x45564157UL);            // "WAVE" in ASCII
+    WriteUnsignedInt(file, 4, 0x20746d66UL);            // "fmt " in ASCII
+    WriteUnsignedInt(file, 4, asFloat ? 18 : 16);       // Format description size.
+    WriteUnsignedInt(file, 2, asFloat ? 3 : 1);         // Audio Format is IEEE float (=3) or PCM (=1).
+    WriteUnsignedInt(file, 2, numChannels);             // NumChannels.
+    WriteUnsignedInt(file, 4, sampleRate);              // SampleRate.
+    WriteUnsignedInt(file, 4, sampleRate*blockAlign);   // ByteRate   = SampleRate*NumChannels*BitsPerSample/8.
+    WriteUnsignedInt(file, 2, blockAlign);              // BlockAlign = NumChannels*BitsPerSample/8.
+    WriteUnsignedInt(file, 2, 8*bytesPerSample);        // BitsPerSample.
+    if (asFloat)
+    {
+        WriteUnsignedInt(file, 2, 0);                   // Size of the format extension.
+        WriteUnsignedInt(file, 4, 0x74636166UL);        // "fact" in ASCII
+        WriteUnsignedInt(file, 4, 4);                   // Fact chunk size.
+        WriteUnsignedInt(file, 4, numSamples);          // Number of samples per channel.
+    }
+    WriteUnsignedInt(file, 4, 0x61746164UL);            // "data" in ASCII
+    WriteUnsignedInt(file, 4, dataSize);                // DataSize.
+
+    // Interleave the amplitude data in large blocks, writing each block at once.
+    const std::size_t blockFrames = (std::size_t(1) << 16);
+    vector<uint8_t>   buffer(std::min<std::size_t>(numSamples, blockFrames)*blockAlign);
+
+    for (std::size_t frame=0; frame<numSamples; frame+=blockFrames)
+    {
+        std::size_t count = std::min<std::size_t>(numSamples-frame, blockFrames);
+
+        for (std::size_t i=0; i<numChannels; i++)
+        {
+            if (asFloat)
+            {
+                InterleaveChannel(amplitudes[i].data()+frame, count,
+                                  buffer.data()+i*bytesPerSample, blockAlign, SI16ToFloat);
+            }
+            else
+            {
+                InterleaveChannel(amplitudes[i].data()+frame, count,
+                                  buffer.data()+i*bytesPerSample, blockAlign, SI16ToSI16);
+            }
+        }
+
+        file.write(reinterpret_cast<const char*>(buffer.data()),
+                   static_cast<std::streamsize>(count*blockAlign));
+    }
+
+    if (file.good() == false)
+        throw error("WavHelper.Save() : Could not write to file.");
 
     file.close();
     return;
@@ -2,20 +2,43 @@
 
 #include <string>
 #include <vector>
+#include <istream>
 #include <cstdint>
+#include <cstddef>
 
 namespace mi
 {
 
-// Currently only handles uncompressed 16 bit linear PCM.
+// Loads uncompressed 8/16/24/32 bit integer and 32 bit float PCM, the samples are converted to
+// 16 bit. Saves 16 bit linear PCM or 32 bit float.
 class WavHelper
 {
 public:
-    // Only uncompressed 16 bit linear PCM wav files are supported.
+    class Header
+    {
+    public:
+        unsigned long  sampleRate;
+        unsigned short numChannels;
+        unsigned short bitsPerSample;
+        unsigned short blockAlign; // Bytes per frame.
+        bool           isFloat;
+        unsigned long  dataSize;   // In bytes.
+    };
+
+    // Chunks other than "fmt " and "data" are skipped.
     void Load(const std::string& filename);
 
+    // Reads the header, leaving the stream at the start of the sample data. The data size is
+    // limited to what the (seekable) stream holds.
+    static void ReadHeader(std::istream& in, Header& header);
+
+    // Converts a single channel of interleaved sample data (in the format given by header) to
+    // 16 bit samples.
+    static void Deinterleave(const Header& header, const std::uint8_t* data, std::size_t numFrames,
+                             std::size_t channel, std::int16_t* output);
+
     // The file will be overwritten if it exists.
-    void Save(const std::string& filename) const;
+    void Save(const std::string& filename, bool asFloat = false) const;
 
     unsigned long sampleRate;
     std::vector<std::vector<std::int16_t>> amplitudes; // [channel][sample].
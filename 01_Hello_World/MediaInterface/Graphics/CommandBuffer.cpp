@@ -0,0 +1,273 @@
+#include "CommandBuffer.h"
+#include "Graphics.h"
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+using error = std::runtime_error;
+using std::to_string;
+using std::uint32_t;
+using std::vector;
+
+namespace mi
+{
+
+void CommandBuffer::Clear() noexcept
+{
+    commands.clear();
+    values.clear();
+    ints.clear();
+    colors.clear();
+    points.clear();
+    rectangles.clear();
+    return;
+}
+
+void CommandBuffer::AddCommand(CommandType type, const ImageHandle& destImg, size_t count)
+{
+    commands.push_back({type, destImg.texture, static_cast<uint32_t>(count)});
+    return;
+}
+
+void CommandBuffer::DrawScaledImage(const ImageHandle& destImg,
+                                    float destX, float destY, float destW, float destH,
+                                    const ImageHandle& srcImg,
+                                    float srcX,  float srcY,  float srcW,  float srcH,
+                                    float alpha,
+                                    const ImageHandle* pMaskImg,
+                                    float maskX, float maskY, float maskW, float maskH,
+                                    const ImageHandle* pPaletteImg,
+                                    float paletteX, float paletteY, float paletteW)
+{
+    AddCommand(CommandType::Texture, destImg);
+    ints.insert(ints.end(), {srcImg.texture,
+                             pMaskImg ? pMaskImg->texture : 0,
+                             pPaletteImg ? pPaletteImg->texture : 0});
+    values.insert(values.end(), {destX, destY, destW, destH,
+                                 srcX,  srcY,  srcW,  srcH,
+                                 alpha,
+                                 maskX, maskY, maskW, maskH,
+                                 paletteX, paletteY, paletteW});
+    return;
+}
+
+void CommandBuffer::DrawScaledPalettedImage(const ImageHandle& destImg,
+                                            float destX, float destY, float destW, float destH,
+                                            const ImageHandle& srcImg,
+                                            float srcX,  float srcY,  float srcW,  float srcH,
+                                            uint32_t paletteRow,
+                                            float alpha,
+                                            const ImageHandle* pMaskImg,
+                                            float maskX, float maskY, float maskW, float maskH)
+{
+    if (paletteRow >= Graphics::paletteStoreRows)
+        throw error("Palette row is outside the palette store");
+
+    AddCommand(CommandType::TextureWithPaletteRow, destImg);
+    ints.insert(ints.end(), {srcImg.texture, pMaskImg ? pMaskImg->texture : 0, paletteRow});
+    values.insert(values.end(), {destX, destY, destW, destH,
+                                 srcX,  srcY,  srcW,  srcH,
+                                 alpha,
+                                 maskX, maskY, maskW, maskH});
+    return;
+}
+
+void CommandBuffer::DrawTriangle(const ImageHandle& destImg,
+                                 float x1, float y1, const Color& c1,
+                                 float x2, float y2, const Color& c2,
+                                 float x3, float y3, const Color& c3)
+{
+    AddCommand(CommandType::Triangle, destImg);
+    values.insert(values.end(), {x1, y1, x2, y2, x3, y3});
+    colors.insert(colors.end(), {c1, c2, c3});
+    return;
+}
+
+void CommandBuffer::DrawRectangle(const ImageHandle& destImg,
+                                  float x, float y, float width, float height, const Color& c)
+{
+    AddCommand(CommandType::Rectangles, destImg, 1);
+    rectangles.push_back({x, y, width, height, c});
+    return;
+}
+
+void CommandBuffer::DrawCircle(const ImageHandle& destImg,
+                               float cx, float cy, float radius, const Color& c)
+{
+    AddCommand(CommandType::Capsule, destImg);
+    values.insert(values.end(), {cx, cy, cx, cy, radius});
+    colors.push_back(c);
+    return;
+}
+
+void CommandBuffer::DrawLine(const ImageHandle& destImg,
+                             float x1, float y1, float x2, float y2,
+                             float thickness, const Color& c)
+{
+    AddCommand(CommandType::Capsule, destImg);
+    values.insert(values.end(), {x1, y1, x2, y2, thickness/2});
+    colors.push_back(c);
+    return;
+}
+
+void CommandBuffer::DrawRectangles(const ImageHandle& destImg,
+                                   const Rectangle* rectangles, size_t size)
+{
+    if (size == 0)
+        return;
+
+    AddCommand(CommandType::Rectangles, destImg, size);
+    this->rectangles.insert(this->rectangles.end(), rectangles, rectangles+size);
+    return;
+}
+
+void CommandBuffer::DrawPolyline(const ImageHandle& destImg,
+                                 const Point* points, size_t size, float thickness, const Color& c)
+{
+    if (size == 0)
+        return;
+
+    AddCommand(CommandType::Polyline, destImg, size);
+    this->points.insert(this->points.end(), points, points+size);
+    values.push_back(thickness/2);
+    colors.push_back(c);
+    return;
+}
+
+void CommandBuffer::DrawTriangleMesh(const ImageHandle& destImg,
+                                     const Point* vertices, const Color* colors,
+                                     size_t numVertices,
+                                     const uint32_t* indices, size_t numIndices)
+{
+    if (numIndices % 3 != 0)
+        throw error("Number of triangle indices must be a multiple of 3");
+
+    for (size_t i=0; i<numIndices; i++)
+    {
+        if (indices[i] >= numVertices)
+            throw error("Triangle index "+to_string(indices[i])+" is out of range");
+    }
+
+    if (numIndices == 0)
+        return;
+
+    AddCommand(CommandType::TriangleMesh, destImg, numVertices);
+    points.insert(points.end(), vertices, vertices+numVertices);
+    this->colors.insert(this->colors.end(), colors, colors+numVertices);
+    ints.push_back(static_cast<uint32_t>(numIndices));
+    ints.insert(ints.end(), indices, indices+numIndices);
+    return;
+}
+
+void CommandBuffer::DrawTriangleMesh(const ImageHandle& destImg,
+                                     const vector<Point>& vertices,
+                                     const vector<Color>& colors,
+                                     const vector<uint32_t>& indices)
+{
+    if (colors.size() != vertices.size())
+        throw error("Triangle mesh needs a color for each vertex");
+
+    DrawTriangleMesh(destImg, vertices.data(), colors.data(), vertices.size(),
+                     indices.data(), indices.size());
+    return;
+}
+
+void CommandBuffer::PushClipRect(const ImageHandle& destImg,
+                                 std::int32_t x, std::int32_t y,
+                                 std::int32_t width, std::int32_t height)
+{
+    AddCommand(CommandType::PushClipRect, destImg);
+    ints.insert(ints.end(), {static_cast<uint32_t>(x),     static_cast<uint32_t>(y),
+                             static_cast<uint32_t>(width), static_cast<uint32_t>(height)});
+    return;
+}
+
+void CommandBuffer::PopClipRect(const ImageHandle& destImg)
+{
+    AddCommand(CommandType::PopClipRect, destImg);
+    return;
+}
+
+void CommandBuffer::Draw(Graphics& graphics) const
+{
+    // Each command reads its data from the front of the vectors, in the order it was recorded.
+    const float*     v = values.data();
+    const uint32_t*  n = ints.data();
+    const Color*     c = colors.data();
+    const Point*     p = points.data();
+    const Rectangle* r = rectangles.data();
+
+    // The Graphics functions batch the commands together (until the image drawn on changes).
+    for (const Command& command : commands)
+    {
+        switch (command.type)
+        {
+        case CommandType::Texture:
+            graphics.DrawTexture(command.destTexture, v[0], v[1], v[2], v[3],
+                                 n[0], v[4], v[5], v[6], v[7], v[8],
+                                 n[1], v[9], v[10], v[11], v[12],
+                                 n[2], v[13], v[14], v[15]);
+            v += 16;
+            n += 3;
+            break;
+
+        case CommandType::TextureWithPaletteRow:
+            graphics.DrawTextureWithPaletteRow(command.destTexture, v[0], v[1], v[2], v[3],
+                                               n[0], v[4], v[5], v[6], v[7], v[8],
+                                               n[1], v[9], v[10], v[11], v[12],
+                                               n[2]);
+            v += 13;
+            n += 3;
+            break;
+
+        case CommandType::Triangle:
+            graphics.DrawTriangle(command.destTexture,
+                                  v[0], v[1], c[0],
+                                  v[2], v[3], c[1],
+                                  v[4], v[5], c[2]);
+            v += 6;
+            c += 3;
+            break;
+
+        case CommandType::Rectangles:
+            graphics.DrawRectangles(command.destTexture, r, command.count);
+            r += command.count;
+            break;
+
+        case CommandType::Capsule:
+            graphics.DrawCapsule(command.destTexture, v[0], v[1], v[2], v[3], v[4], c[0]);
+            v += 5;
+            c += 1;
+            break;
+
+        case CommandType::Polyline:
+            graphics.DrawCapsules(command.destTexture, p, command.count, v[0], c[0]);
+            p += command.count;
+            v += 1;
+            c += 1;
+            break;
+
+        case CommandType::TriangleMesh:
+            graphics.DrawTriangles(command.destTexture, p, c, command.count, n+1, n[0]);
+            p += command.count;
+            c += command.count;
+            n += 1+n[0];
+            break;
+
+        case CommandType::PushClipRect:
+            graphics.PushClipRect(command.destTexture,
+                                  static_cast<std::int32_t>(n[0]), static_cast<std::int32_t>(n[1]),
+                                  static_cast<std::int32_t>(n[2]), static_cast<std::int32_t>(n[3]));
+            n += 4;
+            break;
+
+        case CommandType::PopClipRect:
+            graphics.PopClipRect(command.destTexture);
+            break;
+        }
+    }
+
+    return;
+}
+
+} // End of namespace mi.
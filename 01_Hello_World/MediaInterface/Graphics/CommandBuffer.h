@@ -0,0 +1,163 @@
+#pragma once
+
+#include "Color.h"
+#include "ImageHandle.h"
+#include "Shapes.h"
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace mi
+{
+
+class Graphics; // Forward declare.
+
+// Records draw calls so they can be made on any thread, then drawn later (in the order recorded)
+// on the main thread with MediaInterface::DrawCommands(). Give each thread its own buffer. The
+// images used must not be deleted until the commands have been drawn.
+class CommandBuffer
+{
+public:
+    // Removes the commands (keeping the memory, so reusing a buffer each frame is cheap).
+    void        Clear() noexcept;
+    std::size_t Size() const noexcept { return commands.size(); }
+
+    // These match the ImageHandle functions, with destImg as the image drawn on.
+    void DrawImage(const ImageHandle& destImg,
+                   float destX, float destY,
+                   const ImageHandle& srcImg,
+                   float srcX,  float srcY,  float srcW,  float srcH,
+                   float alpha = 255,
+                   const ImageHandle* pMaskImg = nullptr,
+                   float maskX = 0, float maskY = 0,
+                   const ImageHandle* pPaletteImg = nullptr,
+                   float paletteX = 0, float paletteY = 0, float paletteW = 0)
+    {
+        DrawScaledImage(destImg,
+                        destX, destY, srcW, srcH,
+                        srcImg,
+                        srcX, srcY, srcW, srcH,
+                        alpha,
+                        pMaskImg,
+                        maskX, maskY, srcW, srcH,
+                        pPaletteImg,
+                        paletteX, paletteY, paletteW);
+    }
+    void DrawScaledImage(const ImageHandle& destImg,
+                         float destX, float destY, float destW, float destH,
+                         const ImageHandle& srcImg,
+                         float srcX,  float srcY,  float srcW,  float srcH,
+                         float alpha = 255,
+                         const ImageHandle* pMaskImg = nullptr,
+                         float maskX = 0, float maskY = 0, float maskW = 0, float maskH = 0,
+                         const ImageHandle* pPaletteImg = nullptr,
+                         float paletteX = 0, float paletteY = 0, float paletteW = 0);
+    void DrawPalettedImage(const ImageHandle& destImg,
+                           float destX, float destY,
+                           const ImageHandle& srcImg,
+                           float srcX,  float srcY,  float srcW,  float srcH,
+                           std::uint32_t paletteRow,
+                           float alpha = 255,
+                           const ImageHandle* pMaskImg = nullptr,
+                           float maskX = 0, float maskY = 0)
+    {
+        DrawScaledPalettedImage(destImg,
+                                destX, destY, srcW, srcH,
+                                srcImg,
+                                srcX, srcY, srcW, srcH,
+                                paletteRow,
+                                alpha,
+                                pMaskImg,
+                                maskX, maskY, srcW, srcH);
+    }
+    void DrawScaledPalettedImage(const ImageHandle& destImg,
+                                 float destX, float destY, float destW, float destH,
+                                 const ImageHandle& srcImg,
+                                 float srcX,  float srcY,  float srcW,  float srcH,
+                                 std::uint32_t paletteRow,
+                                 float alpha = 255,
+                                 const ImageHandle* pMaskImg = nullptr,
+                                 float maskX = 0, float maskY = 0,
+                                 float maskW = 0, float maskH = 0);
+    void DrawTriangle(const ImageHandle& destImg,
+                      float x1, float y1, const Color& c1,
+                      float x2, float y2, const Color& c2,
+                      float x3, float y3, const Color& c3);
+    void DrawTriangle(const ImageHandle& destImg,
+                      float x1, float y1,
+                      float x2, float y2,
+                      float x3, float y3,
+                      const Color& c)
+    {
+        DrawTriangle(destImg, x1, y1, c, x2, y2, c, x3, y3, c);
+    }
+    void DrawRectangle(const ImageHandle& destImg,
+                       float x, float y, float width, float height, const Color& c);
+    void DrawCircle(const ImageHandle& destImg, float cx, float cy, float radius, const Color& c);
+    void DrawLine(const ImageHandle& destImg,
+                  float x1, float y1, float x2, float y2, float thickness, const Color& c);
+
+    // These record many shapes as one command (copying them, so the arrays needn't be kept).
+    void DrawRectangles(const ImageHandle& destImg, const Rectangle* rectangles, size_t size);
+    void DrawRectangles(const ImageHandle& destImg, const std::vector<Rectangle>& rectangles)
+        { DrawRectangles(destImg, rectangles.data(), rectangles.size()); }
+    // Lines (with rounded ends) joining consecutive points.
+    void DrawPolyline(const ImageHandle& destImg,
+                      const Point* points, size_t size, float thickness, const Color& c);
+    void DrawPolyline(const ImageHandle& destImg,
+                      const std::vector<Point>& points, float thickness, const Color& c)
+        { DrawPolyline(destImg, points.data(), points.size(), thickness, c); }
+    // A triangle for every 3 indices into vertices, which are checked when recorded (rather than
+    // when drawn on the main thread).
+    void DrawTriangleMesh(const ImageHandle& destImg,
+                          const Point* vertices, const Color* colors, size_t numVertices,
+                          const std::uint32_t* indices, size_t numIndices);
+    void DrawTriangleMesh(const ImageHandle& destImg,
+                          const std::vector<Point>& vertices, const std::vector<Color>& colors,
+                          const std::vector<std::uint32_t>& indices);
+
+    // Pushed and popped when the commands are drawn.
+    void PushClipRect(const ImageHandle& destImg,
+                      std::int32_t x, std::int32_t y, std::int32_t width, std::int32_t height);
+    void PopClipRect(const ImageHandle& destImg);
+
+private:
+    enum class CommandType : std::uint8_t
+    {
+        Texture,
+        TextureWithPaletteRow,
+        Triangle,
+        Rectangles,
+        Capsule,
+        Polyline,
+        TriangleMesh,
+        PushClipRect,
+        PopClipRect
+    };
+
+    // The data of each command is appended to the vectors below, and read back in the same order
+    // when drawn, so a command only holds what varies in size.
+    class Command
+    {
+    public:
+        CommandType   type;
+        std::uint32_t destTexture;
+        std::uint32_t count; // Of rectangles or points.
+    };
+
+    void AddCommand(CommandType type, const ImageHandle& destImg, size_t count = 0);
+
+    // Draws the commands with graphics (only on the main thread).
+    void Draw(Graphics& graphics) const;
+
+    std::vector<Command>       commands;
+    std::vector<float>         values;
+    std::vector<std::uint32_t> ints; // Texture names, palette rows, clip rectangles and indices.
+    std::vector<Color>         colors;
+    std::vector<Point>         points;
+    std::vector<Rectangle>     rectangles;
+
+    friend class MediaInterface;
+};
+
+} // End of namespace mi.
@@ -10,6 +10,10 @@
 #include <vector>
 #include <cstdint>
 #include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
 
 using error = std::runtime_error;
 using std::string;
@@ -24,6 +28,109 @@ using std::uint32_t;
 using std::uint8_t;
 using std::unordered_map;
 
+namespace
+{
+
+// The fewest pixels each thread remaps in CreatePalettedTextureOnCpu().
+const std::size_t minPixelsPerThread = 64*1024;
+
+// An open addressed hash table from pixel colors to palette index pixels (both as the 4 bytes
+// of the pixel), used by CreatePalettedTextureOnCpu().
+class PaletteTable
+{
+public:
+    explicit PaletteTable(std::size_t numColors)
+    {
+        // Keep the table at most half full, so searches only look at a few entries.
+        uint32_t bits = 4;
+        while ((std::size_t(1) << bits) < 2*numColors && bits < 31)
+            bits++;
+
+        entries.assign(std::size_t(1) << bits, Entry{0, 0});
+        mask  = (std::size_t(1) << bits)-1;
+        shift = 32-bits;
+
+        const uint8_t indexZero[4] = {0, 0, 0, 0xff};
+        std::memcpy(&defaultValue, indexZero, 4);
+        return;
+    }
+
+    // Only the first index inserted for a color is kept.
+    void Insert(uint32_t color, const uint8_t* indexPixel)
+    {
+        uint32_t value;
+        std::memcpy(&value, indexPixel, 4);
+
+        for (std::size_t i=Hash(color); ; i=(i+1) & mask)
+        {
+            if (entries[i].value == 0)
+            {
+                entries[i] = Entry{color, value};
+                return;
+            }
+
+            if (entries[i].color == color)
+                return;
+        }
+    }
+
+    // Replaces the pixels in [begin, end) with their index pixels (index 0 if not found).
+    void Remap(uint8_t* begin, uint8_t* end) const
+    {
+        // Neighbouring pixels are often the same color, so remember the last one.
+        uint32_t lastColor = 0;
+        uint32_t lastValue = Find(0);
+        uint32_t color;
+
+        for (uint8_t* p=begin; p<end; p+=4)
+        {
+            std::memcpy(&color, p, 4);
+
+            if (color != lastColor)
+            {
+                lastColor = color;
+                lastValue = Find(color);
+            }
+
+            std::memcpy(p, &lastValue, 4);
+        }
+
+        return;
+    }
+
+private:
+    // A value of 0 marks an empty entry (index pixels always have A = 255).
+    struct Entry
+    {
+        uint32_t color;
+        uint32_t value;
+    };
+
+    std::size_t Hash(uint32_t color) const
+    {
+        return static_cast<uint32_t>(color*2654435761u) >> shift;
+    }
+
+    uint32_t Find(uint32_t color) const
+    {
+        for (std::size_t i=Hash(color); ; i=(i+1) & mask)
+        {
+            if (entries[i].value == 0)
+                return defaultValue;
+
+            if (entries[i].color == color)
+                return entries[i].value;
+        }
+    }
+
+    vector<Entry> entries;
+    std::size_t   mask;
+    uint32_t      shift;
+    uint32_t      defaultValue;
+};
+
+} // End of anonymous namespace.
+
 namespace mi
 {
 
@@ -116,6 +223,10 @@ void Graphics::Free()
 
     // Clear the render data.
     generalRenderData.clear();
+    drawClipTexture = 0;
+
+    paletteStoreTexture = 0;
+    paletteStoreUnit    = 0;
 
     gladInitialized = false;
     return;
@@ -226,6 +337,18 @@ void Graphics::Init(uint32_t screenWidth, uint32_t screenHeight)
     SetUniform(alphaShaderProgram, "texColor", 1);
     SetUniform(alphaShaderProgram, "texAlpha", 2);
 
+    // Create a shader program to replace colors with palette indices.
+    paletteShaderProgram = CreateShaderProgram();
+
+    AttachShader(paletteShaderProgram,
+        ShaderFromString(shader::vertex::blitToImage, GL_VERTEX_SHADER));
+    AttachShader(paletteShaderProgram,
+        ShaderFromString(shader::fragment::createPaletted, GL_FRAGMENT_SHADER));
+    LinkShaderProgram(paletteShaderProgram);
+
+    SetUniform(paletteShaderProgram, "tex",     1);
+    SetUniform(paletteShaderProgram, "palette", 2);
+
     // Create a vertex array for general rendering of 2D images.
     generalRenderVertexArray = CreateVertexArray();
     UseVertexArray(generalRenderVertexArray);
@@ -256,6 +379,10 @@ void Graphics::Init(uint32_t screenWidth, uint32_t screenHeight)
     // 11 (attribute 6) palette texture x coordinate
     // 12 (attribute 6) palette texture y coordinate
     // 13 (attribute 7) palette width
+    // Shapes (type -1) are colored, with no mask or palette. Their mask coordinates are the
+    // position relative to the shape's centre and axis, and their palette coordinates are its half
+    // length and radius.
+    static_assert(sizeof(Vertex) == 14*sizeof(float), "Vertex must match the attributes");
     SetAttributeArray(generalRenderVertexArray, 0, generalRenderBuffer, GL_FLOAT, 2,  0*sf, 14*sf);
     SetAttributeArray(generalRenderVertexArray, 1, generalRenderBuffer, GL_FLOAT, 1,  2*sf, 14*sf);
     SetAttributeArray(generalRenderVertexArray, 2, generalRenderBuffer, GL_FLOAT, 4,  3*sf, 14*sf);
@@ -265,22 +392,48 @@ void Graphics::Init(uint32_t screenWidth, uint32_t screenHeight)
     SetAttributeArray(generalRenderVertexArray, 6, generalRenderBuffer, GL_FLOAT, 2, 11*sf, 14*sf);
     SetAttributeArray(generalRenderVertexArray, 7, generalRenderBuffer, GL_FLOAT, 1, 13*sf, 14*sf);
 
+    // Use as many texture units as both shader stages can sample from, less unit 0 (used for
+    // blitting) and the palette store's unit.
+    GLint maxFragmentUnits = 0;
+    GLint maxVertexUnits   = 0;
+    GLint maxCombinedUnits = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS,          &maxFragmentUnits);
+    glGetIntegerv(GL_MAX_VERTEX_TEXTURE_IMAGE_UNITS,   &maxVertexUnits);
+    glGetIntegerv(GL_MAX_COMBINED_TEXTURE_IMAGE_UNITS, &maxCombinedUnits);
+    CheckGlErrors("Querying texture units");
+
+    const long numCachedTextures =
+        std::min({static_cast<long>(maxFragmentUnits), static_cast<long>(maxVertexUnits),
+                  static_cast<long>(maxCombinedUnits)}) - 2;
+
+    if (numCachedTextures < 1)
+        throw error("Not enough texture units ("+to_string(maxFragmentUnits)+" fragment, "
+                    +to_string(maxVertexUnits)+" vertex).");
+
     // Create a shader program for general rendering of 2D images.
     generalRenderShaderProgram = CreateShaderProgram();
 
     AttachShader(generalRenderShaderProgram,
-        ShaderFromString(shader::vertex::drawToImage, GL_VERTEX_SHADER));
+        ShaderFromString(shader::vertex::DrawToImage(numCachedTextures), GL_VERTEX_SHADER));
     AttachShader(generalRenderShaderProgram,
-        ShaderFromString(shader::fragment::drawToImage, GL_FRAGMENT_SHADER));
+        ShaderFromString(shader::fragment::DrawToImage(numCachedTextures), GL_FRAGMENT_SHADER));
     LinkShaderProgram(generalRenderShaderProgram);
 
-    const long numCachedTextures = 8;
     for (long i=1; i<=numCachedTextures; i++)
         SetUniform(generalRenderShaderProgram, "tex"+to_string(i), i);
 
     // Initialize texture cache object.
     textureCache.Init(this, numCachedTextures);
 
+    // Create the palette store, and keep it bound to the texture unit after the cached ones.
+    paletteStoreUnit    = numCachedTextures+1;
+    paletteStoreTexture = CreateTexture(paletteStoreWidth, paletteStoreRows, nullptr, false);
+    ClearTexture(paletteStoreTexture, Color(0, 0, 0, 0));
+    UseTexture(paletteStoreUnit, paletteStoreTexture);
+
+    SetUniform(generalRenderShaderProgram, "paletteStore",     paletteStoreUnit);
+    SetUniform(generalRenderShaderProgram, "paletteStoreUnit", paletteStoreUnit);
+
     return;
 }
 
@@ -981,6 +1134,10 @@ void Graphics::DeleteTexture(uint32_t texture)
             if (element.second == texture)
                 AttachTexture(element.first, 0);
         }
+
+        // The texture's name may be reused, so forget its clip rectangle.
+        if (drawClipTexture == texture)
+            drawClipTexture = 0;
     }
     catch(...)
     {
@@ -1167,6 +1324,9 @@ void Graphics::DisplayTexture(uint32_t texture)
     glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
     CheckGlErrors("Updating screen");
 
+    // A frame has been shown, so get the texture cache ready for the next one.
+    textureCache.EndFrame();
+
     return;
 }
 
@@ -1305,6 +1465,106 @@ uint32_t Graphics::CreatePalettedTexture(uint32_t texture,
 {
     auto it = textures.find(palette);
 
+    if (it == textures.end())
+        throw error("Couldn't find palette texture");
+
+    // In 64 bits so large values can't wrap around.
+    if (static_cast<std::uint64_t>(paletteX)+paletteW > it->second.width ||
+        static_cast<std::uint64_t>(paletteY)+paletteH > it->second.height)
+        throw error("Palette dimensions are too large");
+
+    if (static_cast<std::uint64_t>(paletteW)*paletteH > maxGpuPaletteColors)
+        return CreatePalettedTextureOnCpu(texture, palette, paletteX, paletteY,
+                                          paletteW, paletteH, smooth);
+
+    it = textures.find(texture);
+
+    if (it == textures.end())
+        throw error("Couldn't find image texture to replace with palette indices");
+
+    uint32_t width  = it->second.width;
+    uint32_t height = it->second.height;
+
+    uint32_t output = 0;
+
+    // Note that the textures are initialized to 0 if they are not already in the maps.
+    // (Which is the behaviour we want.)
+    uint32_t oldTexture1 = texturesInUse[1];
+    uint32_t oldTexture2 = texturesInUse[2];
+
+    try
+    {
+        FlushRenderData(); // We may be drawing using these images.
+
+        // Allocate the output texture.
+        output = CreateTexture(width, height, nullptr, smooth);
+
+        // Set the parameters for the palette shader program.
+        UseFramebuffer(drawFramebuffer);
+        AttachTexture(drawFramebuffer, output);
+
+        UseTextureUnit(1);
+        UseTexture(1, texture);
+        UseTextureUnit(2);
+        UseTexture(2, palette);
+
+        SetViewport(width, height);
+
+        UseVertexArray(fillImageVertexArray);
+        UseShaderProgram(paletteShaderProgram);
+
+        int32_t paletteRect[4] = {static_cast<int32_t>(paletteX), static_cast<int32_t>(paletteY),
+                                  static_cast<int32_t>(paletteW), static_cast<int32_t>(paletteH)};
+        SetUniform(paletteShaderProgram, "paletteRect", paletteRect);
+
+        ClearTexture(output, 0);
+
+        // Each pixel may search the whole palette, so draw in bands of rows to keep each draw call
+        // short (a long running one can trip the driver's watchdog and reset the GPU).
+        const std::uint64_t maxSearchesPerDraw = std::uint64_t(1) << 28;
+        std::uint64_t       searchesPerRow     = std::uint64_t(width)*paletteW*paletteH;
+        std::uint64_t       rowsPerDraw        = maxSearchesPerDraw/std::max<std::uint64_t>(
+                                                     searchesPerRow, 1);
+        uint32_t            bandRows           = static_cast<uint32_t>(
+            std::clamp<std::uint64_t>(rowsPerDraw, 1, std::max(height, 1u)));
+
+        glEnable(GL_SCISSOR_TEST);
+
+        for (uint32_t y=0; y<height; y+=bandRows)
+        {
+            glScissor(0, static_cast<GLint>(y), static_cast<GLsizei>(width),
+                      static_cast<GLsizei>(std::min(bandRows, height-y)));
+            glDrawArrays(GL_TRIANGLE_FAN, 0, 4);
+            glFlush();
+        }
+
+        glDisable(GL_SCISSOR_TEST);
+        CheckGlErrors("Creating paletted texture");
+
+        // Set the textures back.
+        UseTexture(1, oldTexture1);
+        UseTexture(2, oldTexture2);
+
+        return output;
+    }
+    catch(...)
+    {
+        glDisable(GL_SCISSOR_TEST);
+        DeleteTexture(output);
+        UseTexture(1, oldTexture1);
+        UseTexture(2, oldTexture2);
+        throw;
+    }
+}
+
+uint32_t Graphics::CreatePalettedTextureOnCpu(uint32_t texture,
+                                              uint32_t palette,
+                                              uint32_t paletteX, uint32_t paletteY,
+                                              uint32_t paletteW, uint32_t paletteH,
+                                              bool smooth)
+{
+    auto it = textures.find(palette);
+
     if (it == textures.end())
         throw error("Couldn't find palette texture");
 
@@ -1314,27 +1574,30 @@ uint32_t Graphics::CreatePalettedTexture(uint32_t texture,
     vector<uint8_t> pixels;
     GetTexturePixels(palette, pixels);
 
-    // Go through all the pixels in the palette, and create a map of their colors.
-    uint32_t    index = 0;
-    uint32_t    color;
-    std::size_t pixelIndex;
-    unordered_map<uint32_t, uint32_t> colorToIndex;
+    // Go through all the pixels in the palette, and create a table of their colors.
+    // Colors are kept as the 4 bytes of the pixel (in memory order), so the image can be remapped
+    // a whole pixel at a time.
+    PaletteTable colorToIndex(static_cast<std::size_t>(paletteW)*paletteH);
+    uint32_t index = 0;
+    uint32_t color;
 
     for (uint32_t y=paletteY; y<paletteY+paletteH; y++)
     for (uint32_t x=paletteX; x<paletteX+paletteW; x++)
     {
-        pixelIndex = static_cast<std::size_t>(4)*x + static_cast<std::size_t>(4)*y*pixelsWidth;
+        std::size_t pixelIndex = static_cast<std::size_t>(4)*x
+                               + static_cast<std::size_t>(4)*y*pixelsWidth;
 
         if (pixelIndex+3 >= pixels.size())
             throw error("Palette dimensions are too large");
 
-        color = (pixels[pixelIndex+0] << 24)
-              | (pixels[pixelIndex+1] << 16)
-              | (pixels[pixelIndex+2] << 8)
-              | (pixels[pixelIndex+3] << 0);
+        // Store the index in RGB, set A = 255.
+        uint8_t indexPixel[4] = {static_cast<uint8_t>((index >> 16) & 0xff),
+                                 static_cast<uint8_t>((index >> 8) & 0xff),
+                                 static_cast<uint8_t>(index & 0xff),
+                                 0xff};
 
-        if (colorToIndex.find(color) == colorToIndex.end())
-            colorToIndex[color] = (index<<8) | 0xff; // Store the index in RGB, set A = 255.
+        std::memcpy(&color, &pixels[pixelIndex], 4);
+        colorToIndex.Insert(color, indexPixel);
 
         index++;
     }
@@ -1350,23 +1613,39 @@ uint32_t Graphics::CreatePalettedTexture(uint32_t texture,
 
     GetTexturePixels(texture, pixels);
 
-    for (size_t i=0; i<pixels.size(); i+=4)
+    // Split the rows between threads, small images aren't worth starting threads for.
+    uint32_t numThreads = std::max(1u, std::thread::hardware_concurrency());
+    numThreads = std::min(numThreads,
+                          static_cast<uint32_t>(pixels.size()/(4*minPixelsPerThread))+1);
+    numThreads = std::min(numThreads, std::max(1u, pixelsHeight));
+
+    auto remapRows = [&](uint32_t firstRow, uint32_t lastRow)
     {
-        color = (pixels[i+0] << 24)
-              | (pixels[i+1] << 16)
-              | (pixels[i+2] << 8)
-              | (pixels[i+3] << 0);
+        uint8_t* p   = pixels.data()+static_cast<std::size_t>(4)*firstRow*pixelsWidth;
+        uint8_t* end = pixels.data()+static_cast<std::size_t>(4)*lastRow*pixelsWidth;
+        colorToIndex.Remap(p, end);
+    };
 
-        if (colorToIndex.find(color) == colorToIndex.end())
-            color = 0xff;  // Default to index 0.
-        else
-            color = colorToIndex[color];
+    vector<std::thread> threads;
+    uint32_t rowsPerThread = pixelsHeight/numThreads;
 
-        pixels[i+0] = (color >> 24) & 0xff;
-        pixels[i+1] = (color >> 16) & 0xff;
-        pixels[i+2] = (color >> 8)  & 0xff;
-        pixels[i+3] = (color >> 0)  & 0xff;
+    try
+    {
+        for (uint32_t t=1; t<numThreads; t++)
+            threads.emplace_back(remapRows, t*rowsPerThread,
+                                 (t+1 == numThreads) ? pixelsHeight : (t+1)*rowsPerThread);
     }
+    catch(...)
+    {
+        for (std::thread& thread : threads)
+            thread.join();
+        throw;
+    }
+
+    remapRows(0, (numThreads == 1) ? pixelsHeight : rowsPerThread);
+
+    for (std::thread& thread : threads)
+        thread.join();
 
     return CreateTexture(pixelsWidth, pixelsHeight, pixels.data(), smooth);
 }
@@ -1381,16 +1660,23 @@ void Graphics::DrawTexture(uint32_t destTexture,
                            uint32_t paletteTexture,
                            float paletteX, float paletteY, float paletteW)
 {
-    // Update the drawFramebuffer if the destination texture has changed.
-    if (destTexture != framebuffers[drawFramebuffer])
-    {
-        FlushRenderData();
-        UseFramebuffer(drawFramebuffer);
-        AttachTexture(drawFramebuffer, destTexture);
-    }
+    UseDrawTarget(destTexture);
+
+    // Skip anything that wouldn't be seen (e.g. off screen tiles).
+    if (IsOutsideDrawClip(destX, destY, destW, destH))
+        return;
+
+    // Update the texture cache, adding the textures together so none replaces another.
+    uint32_t cached[3] = {srcTexture};
+    size_t   numCached = 1;
 
-    // Update the texture cache.
-    textureCache.Add(&srcTexture, 1);
+    if (maskTexture != 0)
+        cached[numCached++] = maskTexture;
+
+    if (paletteTexture != 0)
+        cached[numCached++] = paletteTexture;
+
+    textureCache.Add(cached, numCached);
     float textureUnit = static_cast<float>(textureCache.GetTextureUnit(srcTexture));
 
     float maskTextureUnit;
@@ -1405,10 +1691,7 @@ void Graphics::DrawTexture(uint32_t destTexture,
         maskH = 0;
     }
     else
-    {
-        textureCache.Add(&maskTexture, 1);
         maskTextureUnit = static_cast<float>(textureCache.GetTextureUnit(maskTexture));
-    }
 
     float paletteTextureUnit;
 
@@ -1421,74 +1704,302 @@ void Graphics::DrawTexture(uint32_t destTexture,
         paletteW = 0;
     }
     else
-    {
-        textureCache.Add(&paletteTexture, 1);
         paletteTextureUnit = static_cast<float>(textureCache.GetTextureUnit(paletteTexture));
+
+    AddTexturedRectangle(destX, destY, destW, destH,
+                         textureUnit, srcX, srcY, srcW, srcH, alpha,
+                         maskTextureUnit, maskX, maskY, maskW, maskH,
+                         paletteTextureUnit, paletteX, paletteY, paletteW);
+    return;
+}
+
+void Graphics::DrawTextureWithPaletteRow(uint32_t destTexture,
+                                         float destX, float destY, float destW, float destH,
+                                         uint32_t srcTexture,
+                                         float srcX, float srcY, float srcW, float srcH,
+                                         float alpha,
+                                         uint32_t maskTexture,
+                                         float maskX, float maskY, float maskW, float maskH,
+                                         uint32_t paletteRow)
+{
+    if (paletteRow >= paletteStoreRows)
+        throw error("Palette row is outside the palette store");
+
+    UseDrawTarget(destTexture);
+
+    // Skip anything that wouldn't be seen (e.g. off screen tiles).
+    if (IsOutsideDrawClip(destX, destY, destW, destH))
+        return;
+
+    // Update the texture cache (the palette store isn't part of it).
+    uint32_t cached[2] = {srcTexture, maskTexture};
+    textureCache.Add(cached, (maskTexture == 0) ? 1 : 2);
+    float textureUnit = static_cast<float>(textureCache.GetTextureUnit(srcTexture));
+
+    float maskTextureUnit = 0;
+
+    if (maskTexture == 0)
+    {
+        // Don't use a mask.
+        maskX = 0;
+        maskY = 0;
+        maskW = 0;
+        maskH = 0;
+    }
+    else
+        maskTextureUnit = static_cast<float>(textureCache.GetTextureUnit(maskTexture));
+
+    AddTexturedRectangle(destX, destY, destW, destH,
+                         textureUnit, srcX, srcY, srcW, srcH, alpha,
+                         maskTextureUnit, maskX, maskY, maskW, maskH,
+                         static_cast<float>(paletteStoreUnit),
+                         0, static_cast<float>(paletteRow), static_cast<float>(paletteStoreWidth));
+    return;
+}
+
+void Graphics::UseDrawTarget(uint32_t destTexture)
+{
+    // Update the drawFramebuffer if the destination texture has changed.
+    if (destTexture != framebuffers[drawFramebuffer])
+    {
+        FlushRenderData();
+        UseFramebuffer(drawFramebuffer);
+        AttachTexture(drawFramebuffer, destTexture);
     }
 
-    // Add the data to the generalRenderData.
-    generalRenderData.push_back(destX);
-    generalRenderData.push_back(destY);
-    generalRenderData.push_back(textureUnit);
-    generalRenderData.push_back(srcX);
-    generalRenderData.push_back(srcY);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(alpha);
-    generalRenderData.push_back(maskTextureUnit);
-    generalRenderData.push_back(maskX);
-    generalRenderData.push_back(maskY);
-    generalRenderData.push_back(paletteTextureUnit);
-    generalRenderData.push_back(paletteX);
-    generalRenderData.push_back(paletteY);
-    generalRenderData.push_back(paletteW);
-
-    for (long i=0; i<2; i++)
-    {
-        generalRenderData.push_back(destX + destW);
-        generalRenderData.push_back(destY);
-        generalRenderData.push_back(textureUnit);
-        generalRenderData.push_back(srcX + srcW);
-        generalRenderData.push_back(srcY);
-        generalRenderData.push_back(0);
-        generalRenderData.push_back(alpha);
-        generalRenderData.push_back(maskTextureUnit);
-        generalRenderData.push_back(maskX + maskW);
-        generalRenderData.push_back(maskY);
-        generalRenderData.push_back(paletteTextureUnit);
-        generalRenderData.push_back(paletteX);
-        generalRenderData.push_back(paletteY);
-        generalRenderData.push_back(paletteW);
-
-        generalRenderData.push_back(destX);
-        generalRenderData.push_back(destY + destH);
-        generalRenderData.push_back(textureUnit);
-        generalRenderData.push_back(srcX);
-        generalRenderData.push_back(srcY + srcH);
-        generalRenderData.push_back(0);
-        generalRenderData.push_back(alpha);
-        generalRenderData.push_back(maskTextureUnit);
-        generalRenderData.push_back(maskX);
-        generalRenderData.push_back(maskY + maskH);
-        generalRenderData.push_back(paletteTextureUnit);
-        generalRenderData.push_back(paletteX);
-        generalRenderData.push_back(paletteY);
-        generalRenderData.push_back(paletteW);
+    // Other functions use the drawFramebuffer too, so the clip rectangle is tracked separately.
+    if (destTexture != drawClipTexture)
+    {
+        auto it = textures.find(destTexture);
+
+        drawClip        = (it != textures.end()) ? it->second.GetClipRect() : ClipRect{0, 0, 0, 0};
+        drawClipTexture = destTexture;
     }
 
-    generalRenderData.push_back(destX + destW);
-    generalRenderData.push_back(destY + destH);
-    generalRenderData.push_back(textureUnit);
-    generalRenderData.push_back(srcX + srcW);
-    generalRenderData.push_back(srcY + srcH);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(alpha);
-    generalRenderData.push_back(maskTextureUnit);
-    generalRenderData.push_back(maskX + maskW);
-    generalRenderData.push_back(maskY + maskH);
-    generalRenderData.push_back(paletteTextureUnit);
-    generalRenderData.push_back(paletteX);
-    generalRenderData.push_back(paletteY);
-    generalRenderData.push_back(paletteW);
+    return;
+}
+
+bool Graphics::IsOutsideDrawClip(float x, float y, float width, float height) const
+{
+    // The width and height may be negative (to flip the image).
+    float minX = std::min(x, x+width);
+    float maxX = std::max(x, x+width);
+    float minY = std::min(y, y+height);
+    float maxY = std::max(y, y+height);
+
+    return maxX <= static_cast<float>(drawClip.x0) || minX >= static_cast<float>(drawClip.x1) ||
+           maxY <= static_cast<float>(drawClip.y0) || minY >= static_cast<float>(drawClip.y1);
+}
+
+void Graphics::PushClipRect(uint32_t texture, int32_t x, int32_t y, int32_t width, int32_t height)
+{
+    auto it = textures.find(texture);
+
+    if (it == textures.end())
+        throw error("Couldn't find texture to clip");
+
+    // Keep within the current clip rectangle (which is within the texture).
+    ClipRect current = it->second.GetClipRect();
+    ClipRect clip;
+    clip.x0 = std::max(current.x0, x);
+    clip.y0 = std::max(current.y0, y);
+    clip.x1 = std::max(clip.x0, std::min(current.x1, x+std::max(width,  0)));
+    clip.y1 = std::max(clip.y0, std::min(current.y1, y+std::max(height, 0)));
+
+    // Draw what is waiting with the old clip rectangle.
+    if (texture == framebuffers[drawFramebuffer])
+        FlushRenderData();
+
+    it->second.clipRects.push_back(clip);
+
+    if (texture == drawClipTexture)
+        drawClip = clip;
+
+    return;
+}
+
+void Graphics::PopClipRect(uint32_t texture)
+{
+    auto it = textures.find(texture);
+
+    if (it == textures.end() || it->second.clipRects.empty())
+        throw error("No clip rectangle to pop");
+
+    // Draw what is waiting with the old clip rectangle.
+    if (texture == framebuffers[drawFramebuffer])
+        FlushRenderData();
+
+    it->second.clipRects.pop_back();
+
+    if (texture == drawClipTexture)
+        drawClip = it->second.GetClipRect();
+
+    return;
+}
+
+Graphics::Vertex* Graphics::AddVertices(size_t numVertices)
+{
+    // resize() grows the capacity geometrically (and it's kept between frames), so this rarely
+    // allocates. The new vertices are left uninitialized for the caller to write.
+    size_t oldSize = generalRenderData.size();
+    generalRenderData.resize(oldSize + numVertices);
+    return generalRenderData.data()+oldSize;
+}
+
+void Graphics::AddTexturedRectangle(float destX, float destY, float destW, float destH,
+                                    float textureUnit,
+                                    float srcX, float srcY, float srcW, float srcH,
+                                    float alpha,
+                                    float maskTextureUnit,
+                                    float maskX, float maskY, float maskW, float maskH,
+                                    float paletteTextureUnit,
+                                    float paletteX, float paletteY, float paletteW)
+{
+    Vertex* out = AddVertices(6);
+
+    out[0] = Vertex(destX, destY,
+                    textureUnit, srcX, srcY, 0, alpha,
+                    maskTextureUnit, maskX, maskY,
+                    paletteTextureUnit, paletteX, paletteY, paletteW);
+    out[1] = Vertex(destX + destW, destY,
+                    textureUnit, srcX + srcW, srcY, 0, alpha,
+                    maskTextureUnit, maskX + maskW, maskY,
+                    paletteTextureUnit, paletteX, paletteY, paletteW);
+    out[2] = Vertex(destX, destY + destH,
+                    textureUnit, srcX, srcY + srcH, 0, alpha,
+                    maskTextureUnit, maskX, maskY + maskH,
+                    paletteTextureUnit, paletteX, paletteY, paletteW);
+    out[3] = out[1];
+    out[4] = out[2];
+    out[5] = Vertex(destX + destW, destY + destH,
+                    textureUnit, srcX + srcW, srcY + srcH, 0, alpha,
+                    maskTextureUnit, maskX + maskW, maskY + maskH,
+                    paletteTextureUnit, paletteX, paletteY, paletteW);
+    return;
+}
+
+Graphics::Vertex* Graphics::WriteCapsule(Vertex* out,
+                                         float x1, float y1, float x2, float y2, float radius,
+                                         const Color& c)
+{
+    if (radius < 0)
+        radius = -radius;
+
+    // The axis of the capsule (along the x axis for a circle).
+    float ux = x2-x1;
+    float uy = y2-y1;
+    float halfLength = std::sqrt(ux*ux+uy*uy)/2;
+
+    if (halfLength > 0)
+    {
+        ux /= 2*halfLength;
+        uy /= 2*halfLength;
+    }
+    else
+    {
+        ux = 1;
+        uy = 0;
+    }
+
+    // Cover the capsule with a rectangle, with an extra pixel around it for anti-aliasing.
+    float centreX = (x1+x2)/2;
+    float centreY = (y1+y2)/2;
+    float extentX = halfLength+radius+1;
+    float extentY = radius+1;
+
+    const float corners[6][2] = {{-1, -1}, {1, -1}, {-1, 1}, {1, -1}, {-1, 1}, {1, 1}};
+
+    for (const auto& corner : corners)
+    {
+        float localX = corner[0]*extentX;
+        float localY = corner[1]*extentY;
+
+        *out++ = Vertex(centreX + localX*ux - localY*uy, centreY + localX*uy + localY*ux,
+                        -1, c.r, c.g, c.b, c.a,
+                        0, localX, localY,
+                        0, halfLength, radius, 0);
+    }
+
+    return out;
+}
+
+void Graphics::DrawCapsule(uint32_t destTexture,
+                           float x1, float y1, float x2, float y2, float radius,
+                           const Color& c)
+{
+    UseDrawTarget(destTexture);
+    WriteCapsule(AddVertices(6), x1, y1, x2, y2, radius, c);
+    return;
+}
+
+void Graphics::DrawCapsules(uint32_t destTexture, const Point* points, size_t size,
+                            float radius, const Color& c)
+{
+    if (size == 0)
+        return;
+
+    UseDrawTarget(destTexture);
+
+    if (size == 1)
+    {
+        WriteCapsule(AddVertices(6), points[0].x, points[0].y, points[0].x, points[0].y,
+                     radius, c);
+        return;
+    }
+
+    Vertex* out = AddVertices(6*(size-1));
+
+    for (size_t i=1; i<size; i++)
+        out = WriteCapsule(out, points[i-1].x, points[i-1].y, points[i].x, points[i].y, radius, c);
+
+    return;
+}
+
+void Graphics::DrawRectangles(uint32_t destTexture, const Rectangle* rectangles, size_t size)
+{
+    UseDrawTarget(destTexture);
+
+    Vertex* out = AddVertices(6*size);
+
+    for (size_t i=0; i<size; i++)
+    {
+        const Rectangle& r = rectangles[i];
+
+        *out++ = Vertex(r.x,         r.y,          r.c);
+        *out++ = Vertex(r.x+r.width, r.y,          r.c);
+        *out++ = Vertex(r.x+r.width, r.y+r.height, r.c);
+        *out++ = Vertex(r.x,         r.y,          r.c);
+        *out++ = Vertex(r.x,         r.y+r.height, r.c);
+        *out++ = Vertex(r.x+r.width, r.y+r.height, r.c);
+    }
+
+    return;
+}
+
+void Graphics::DrawTriangles(uint32_t destTexture,
+                             const Point* vertices, const Color* colors, size_t numVertices,
+                             const uint32_t* indices, size_t numIndices)
+{
+    if (numIndices % 3 != 0)
+        throw error("Number of triangle indices must be a multiple of 3");
+
+    UseDrawTarget(destTexture);
+
+    size_t  oldSize = generalRenderData.size();
+    Vertex* out     = AddVertices(numIndices);
+
+    for (size_t i=0; i<numIndices; i++)
+    {
+        uint32_t index = indices[i];
+
+        if (index >= numVertices)
+        {
+            generalRenderData.resize(oldSize);
+            throw error("Triangle index "+to_string(index)+" is out of range");
+        }
+
+        *out++ = Vertex(vertices[index].x, vertices[index].y, colors[index]);
+    }
 
     return;
 }
@@ -1498,59 +2009,95 @@ void Graphics::DrawTriangle(uint32_t destTexture,
                             float x2, float y2, const Color& c2,
                             float x3, float y3, const Color& c3)
 {
-    // Update the drawFramebuffer if the destination texture has changed.
-    if (destTexture != framebuffers[drawFramebuffer])
+    UseDrawTarget(destTexture);
+
+    Vertex* out = AddVertices(3);
+    out[0] = Vertex(x1, y1, c1);
+    out[1] = Vertex(x2, y2, c2);
+    out[2] = Vertex(x3, y3, c3);
+    return;
+}
+
+void Graphics::SetPaletteRow(uint32_t row, const Color* colors, size_t numColors)
+{
+    if (row >= paletteStoreRows || numColors > paletteStoreWidth)
+        throw error("Palette is outside the palette store");
+
+    if (numColors == 0)
+        return;
+
+    // Store the colors premultiplied by alpha, like the other textures.
+    vector<uint8_t> pixels(4*numColors);
+
+    for (size_t i=0; i<numColors; i++)
     {
-        FlushRenderData();
-        UseFramebuffer(drawFramebuffer);
-        AttachTexture(drawFramebuffer, destTexture);
+        uint32_t a = colors[i].a;
+        pixels[4*i+0] = static_cast<uint8_t>((colors[i].r*a+127)/255);
+        pixels[4*i+1] = static_cast<uint8_t>((colors[i].g*a+127)/255);
+        pixels[4*i+2] = static_cast<uint8_t>((colors[i].b*a+127)/255);
+        pixels[4*i+3] = static_cast<uint8_t>(a);
+    }
+
+    FlushRenderData(); // Earlier draws may use the old colors.
+
+    uint32_t oldTextureUnitInUse = textureUnitInUse;
+
+    try
+    {
+        UseTextureUnit(paletteStoreUnit);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, row, static_cast<GLsizei>(numColors), 1,
+                        GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+        CheckGlErrors("Setting palette row");
+
+        UseTextureUnit(oldTextureUnitInUse);
+    }
+    catch(...)
+    {
+        UseTextureUnit(oldTextureUnitInUse);
+        throw;
     }
 
-    // Add the data to the generalRenderData.
-    generalRenderData.push_back(x1);
-    generalRenderData.push_back(y1);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(c1.r);
-    generalRenderData.push_back(c1.g);
-    generalRenderData.push_back(c1.b);
-    generalRenderData.push_back(c1.a);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-
-    generalRenderData.push_back(x2);
-    generalRenderData.push_back(y2);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(c2.r);
-    generalRenderData.push_back(c2.g);
-    generalRenderData.push_back(c2.b);
-    generalRenderData.push_back(c2.a);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-
-    generalRenderData.push_back(x3);
-    generalRenderData.push_back(y3);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(c3.r);
-    generalRenderData.push_back(c3.g);
-    generalRenderData.push_back(c3.b);
-    generalRenderData.push_back(c3.a);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
-    generalRenderData.push_back(0);
+    return;
+}
+
+void Graphics::SetPaletteRow(uint32_t row, uint32_t palette,
+                             uint32_t paletteX, uint32_t paletteY, uint32_t paletteW)
+{
+    auto it = textures.find(palette);
+
+    if (it == textures.end())
+        throw error("Couldn't find palette texture");
+
+    if (row >= paletteStoreRows || paletteW > paletteStoreWidth)
+        throw error("Palette is outside the palette store");
+
+    if (paletteX+paletteW > it->second.width || paletteY >= it->second.height)
+        throw error("Palette dimensions are too large");
+
+    if (paletteW == 0)
+        return;
+
+    FlushRenderData(); // Earlier draws may use the old colors.
+
+    // Copy from the palette (attached to the framebuffer) into the palette store.
+    UseFramebuffer(drawFramebuffer);
+    AttachTexture(drawFramebuffer, palette);
+
+    uint32_t oldTextureUnitInUse = textureUnitInUse;
+
+    try
+    {
+        UseTextureUnit(paletteStoreUnit);
+        glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, row, paletteX, paletteY, paletteW, 1);
+        CheckGlErrors("Copying palette row");
+
+        UseTextureUnit(oldTextureUnitInUse);
+    }
+    catch(...)
+    {
+        UseTextureUnit(oldTextureUnitInUse);
+        throw;
+    }
 
     return;
 }
@@ -1599,10 +2146,24 @@ void Graphics::FlushRenderData()
     UseArrayBuffer(generalRenderBuffer);
     SetArrayData(generalRenderBuffer,
                  generalRenderData.data(),
-                 generalRenderData.size()*sizeof(float));
+                 generalRenderData.size()*sizeof(Vertex));
+
+    // Limit the drawing to the clip rectangle (if there is one).
+    bool clipped = !texData.clipRects.empty();
+
+    if (clipped)
+    {
+        const ClipRect& clip = texData.clipRects.back();
+        glEnable(GL_SCISSOR_TEST);
+        glScissor(clip.x0, clip.y0, clip.x1-clip.x0, clip.y1-clip.y0);
+    }
 
     // Execute the command to draw.
-    glDrawArrays(GL_TRIANGLES, 0, static_cast<GLsizei>(generalRenderData.size()/10));
+    glDrawArrays(GL_TRIANGLES, 0, static_cast<GLsizei>(generalRenderData.size()));
+
+    if (clipped)
+        glDisable(GL_SCISSOR_TEST);
+
     CheckGlErrors("Drawing on image");
 
     // Clear the queue of data waiting to be drawn.
@@ -2,6 +2,7 @@
 
 #include "Glad/glad.h"
 #include "Color.h"
+#include "Shapes.h"
 #include "TextureCache.h"
 #include <string>
 #include <vector>
@@ -89,7 +90,8 @@ public:
     std::uint32_t AddTransparency(std::uint32_t texture, const Color& keyColor, bool smooth);
     std::uint32_t AddTransparency(std::uint32_t colorTexture, std::uint32_t alphaTexture,
                                   bool smooth);
-    // Done by the CPU so is slow.
+    // Done by the GPU, unless the palette has more than maxGpuPaletteColors (as each pixel
+    // searches the palette), then it's done by the CPU which is slow.
     std::uint32_t CreatePalettedTexture(std::uint32_t texture,
                                         std::uint32_t palette,
                                         std::uint32_t paletteX, std::uint32_t paletteY,
@@ -106,17 +108,133 @@ public:
                               float maskX, float maskY, float maskW, float maskH,
                               std::uint32_t paletteTexture,
                               float paletteX, float paletteY, float paletteW);
+    // As above, with the palette given by a row of the palette store.
+    void          DrawTextureWithPaletteRow(std::uint32_t destTexture,
+                                            float destX, float destY, float destW, float destH,
+                                            std::uint32_t srcTexture,
+                                            float srcX, float srcY, float srcW, float srcH,
+                                            float alpha,
+                                            std::uint32_t maskTexture,
+                                            float maskX, float maskY, float maskW, float maskH,
+                                            std::uint32_t paletteRow);
+    // Draws the points within radius of the line from (x1, y1) to (x2, y2) (so a circle if they
+    // are the same) as a single anti-aliased rectangle.
+    void          DrawCapsule(std::uint32_t destTexture,
+                              float x1, float y1, float x2, float y2, float radius,
+                              const Color& c);
+    // Draws a capsule between each pair of consecutive points (a circle if there is one point).
+    void          DrawCapsules(std::uint32_t destTexture, const Point* points, size_t size,
+                               float radius, const Color& c);
+    void          DrawRectangles(std::uint32_t destTexture, const Rectangle* rectangles,
+                                 size_t size);
+    // Draws a triangle for every 3 indices into vertices (and their colors).
+    void          DrawTriangles(std::uint32_t destTexture,
+                                const Point* vertices, const Color* colors, size_t numVertices,
+                                const std::uint32_t* indices, size_t numIndices);
     void          DrawTriangle(std::uint32_t destTexture,
                                float x1, float y1, const Color& c1,
                                float x2, float y2, const Color& c2,
                                float x3, float y3, const Color& c3);
 
+    // The palette store is a texture holding paletteStoreRows palettes (of up to
+    // paletteStoreWidth colors each), kept bound to its own texture unit. So drawing with a row of
+    // it doesn't use the texture cache, and draws using different rows can be batched together.
+    // Changing a row only flushes the pending draws, rather than creating a new texture.
+    static const std::uint32_t paletteStoreWidth = 256;
+    static const std::uint32_t paletteStoreRows  = 256;
+    void          SetPaletteRow(std::uint32_t row, const Color* colors, size_t numColors);
+    // Copies paletteW colors starting at (paletteX, paletteY) of the palette texture (on the GPU).
+    void          SetPaletteRow(std::uint32_t row, std::uint32_t palette,
+                                std::uint32_t paletteX, std::uint32_t paletteY,
+                                std::uint32_t paletteW);
+
+    // Drawing on the texture (but not clearing it) is limited to the intersection of the clip
+    // rectangles pushed, and rectangles drawn entirely outside it (or the texture) are skipped.
+    // The clip rectangles are kept with the texture, and each one needs to be popped.
+    void          PushClipRect(std::uint32_t texture, std::int32_t x, std::int32_t y,
+                               std::int32_t width, std::int32_t height);
+    void          PopClipRect(std::uint32_t texture);
+
     void          UpdateTextureCache(const std::uint32_t* textures, size_t size);
     void          ClearTextureCache();
 
     void          FlushRenderData();
 
+    static const std::uint32_t maxGpuPaletteColors = 256;
+
 private:
+    // A vertex of generalRenderData (see Init() for what each value means).
+    class Vertex
+    {
+    public:
+        Vertex() noexcept {} // Left uninitialized, so making room for vertices is cheap.
+
+        // A colored vertex.
+        Vertex(float x, float y, const Color& c) noexcept
+            : x{x}, y{y}, type{0},
+              col{static_cast<float>(c.r), static_cast<float>(c.g),
+                  static_cast<float>(c.b), static_cast<float>(c.a)},
+              maskType{0}, maskX{0}, maskY{0},
+              paletteType{0}, paletteX{0}, paletteY{0}, paletteW{0} {}
+
+        Vertex(float x, float y,
+               float type, float col0, float col1, float col2, float col3,
+               float maskType, float maskX, float maskY,
+               float paletteType, float paletteX, float paletteY, float paletteW) noexcept
+            : x{x}, y{y}, type{type}, col{col0, col1, col2, col3},
+              maskType{maskType}, maskX{maskX}, maskY{maskY},
+              paletteType{paletteType}, paletteX{paletteX}, paletteY{paletteY},
+              paletteW{paletteW} {}
+
+        float x;
+        float y;
+        float type;
+        float col[4];
+        float maskType;
+        float maskX;
+        float maskY;
+        float paletteType;
+        float paletteX;
+        float paletteY;
+        float paletteW;
+    };
+
+    // Pixels [x0, x1) by [y0, y1).
+    class ClipRect
+    {
+    public:
+        std::int32_t x0;
+        std::int32_t y0;
+        std::int32_t x1;
+        std::int32_t y1;
+    };
+
+    // Binds the drawFramebuffer to destTexture (flushing first) if it isn't already.
+    void          UseDrawTarget(std::uint32_t destTexture);
+    // Whether the rectangle is entirely outside drawClip (so drawing it can be skipped).
+    bool          IsOutsideDrawClip(float x, float y, float width, float height) const;
+    // Makes room for numVertices at the end of generalRenderData, returning where they start.
+    Vertex*       AddVertices(size_t numVertices);
+    // Writes the 6 vertices of a capsule (see DrawCapsule()), returning the next vertex.
+    static Vertex* WriteCapsule(Vertex* out,
+                                float x1, float y1, float x2, float y2, float radius,
+                                const Color& c);
+    // Adds the two triangles of a textured rectangle to generalRenderData.
+    void          AddTexturedRectangle(float destX, float destY, float destW, float destH,
+                                       float textureUnit,
+                                       float srcX, float srcY, float srcW, float srcH,
+                                       float alpha,
+                                       float maskTextureUnit,
+                                       float maskX, float maskY, float maskW, float maskH,
+                                       float paletteTextureUnit,
+                                       float paletteX, float paletteY, float paletteW);
+
+    std::uint32_t CreatePalettedTextureOnCpu(std::uint32_t texture,
+                                             std::uint32_t palette,
+                                             std::uint32_t paletteX, std::uint32_t paletteY,
+                                             std::uint32_t paletteW, std::uint32_t paletteH,
+                                             bool smooth);
+
     // Data.
     bool          gladInitialized = false;
     std::uint32_t screenWidth  = 0;
@@ -125,11 +243,16 @@ private:
     std::uint32_t fillImageVertexArray = 0; // For blitting image to the entire screen.
     std::uint32_t maskShaderProgram    = 0;
     std::uint32_t alphaShaderProgram   = 0;
+    std::uint32_t paletteShaderProgram = 0;
     std::uint32_t drawFramebuffer      = 0; // For rendering on to a texture/Image.
     std::uint32_t generalRenderShaderProgram = 0;
     std::uint32_t generalRenderVertexArray   = 0;
     std::uint32_t generalRenderBuffer        = 0;
-    std::vector<float> generalRenderData;
+    std::vector<Vertex> generalRenderData;
+    ClipRect      drawClip        = {0, 0, 0, 0}; // The clip rectangle of drawClipTexture.
+    std::uint32_t drawClipTexture = 0;            // The last texture passed to UseDrawTarget().
+    std::uint32_t paletteStoreTexture = 0;
+    std::uint32_t paletteStoreUnit    = 0; // The texture unit after the texture cache's units.
 
     std::uint32_t viewportWidth  = 0;
     std::uint32_t viewportHeight = 0;
@@ -152,6 +275,16 @@ private:
         bool          smooth;
 
         std::uint32_t refCount;
+
+        std::vector<ClipRect> clipRects; // The last is the one in use.
+
+        ClipRect GetClipRect() const
+        {
+            if (clipRects.empty())
+                return {0, 0, static_cast<std::int32_t>(width), static_cast<std::int32_t>(height)};
+
+            return clipRects.back();
+        }
     };
 
     std::unordered_set<std::uint32_t> buffers;
@@ -1,14 +1,12 @@
 #include "ImageHandle.h"
 #include "Graphics.h"
 #include <cstdint>
-#include <cmath>
+#include <stdexcept>
+#include <vector>
 
+using error = std::runtime_error;
 using std::uint32_t;
-using std::sin;
-using std::cos;
-using std::sqrt;
-
-const double PI = 3.1415926535897932384626433832795;
+using std::vector;
 
 namespace mi
 {
@@ -154,6 +152,19 @@ void ImageHandle::Clear(const Color& c) const
     return;
 }
 
+void ImageHandle::PushClipRect(std::int32_t x, std::int32_t y,
+                               std::int32_t width, std::int32_t height) const
+{
+    graphics->PushClipRect(texture, x, y, width, height);
+    return;
+}
+
+void ImageHandle::PopClipRect() const
+{
+    graphics->PopClipRect(texture);
+    return;
+}
+
 std::vector<std::uint8_t> ImageHandle::GetPixelData() const
 {
     std::vector<std::uint8_t> pixels;
@@ -186,6 +197,26 @@ void ImageHandle::DrawScaledImage(float destX, float destY, float destW, float d
     return;
 }
 
+void ImageHandle::DrawScaledPalettedImage(float destX, float destY, float destW, float destH,
+                                          const ImageHandle& srcImg,
+                                          float srcX,  float srcY,  float srcW,  float srcH,
+                                          std::uint32_t paletteRow,
+                                          float alpha,
+                                          const ImageHandle* pMaskImg,
+                                          float maskX, float maskY, float maskW, float maskH) const
+{
+    uint32_t maskTexture = 0;
+
+    if (pMaskImg)
+        maskTexture = pMaskImg->texture;
+
+    graphics->DrawTextureWithPaletteRow(texture, destX, destY, destW, destH,
+                                        srcImg.texture, srcX, srcY, srcW, srcH, alpha,
+                                        maskTexture, maskX, maskY, maskW, maskH,
+                                        paletteRow);
+    return;
+}
+
 void ImageHandle::DrawTriangle(float x1, float y1, const Color& c1,
                                float x2, float y2, const Color& c2,
                                float x3, float y3, const Color& c3) const
@@ -211,152 +242,54 @@ void ImageHandle::DrawTriangle(float x1, float y1,
 
 void ImageHandle::DrawRectangle(float x, float y, float width, float height, const Color& c) const
 {
-    graphics->DrawTriangle(texture,
-                           x,       y,        c,
-                           x+width, y,        c,
-                           x+width, y+height, c);
-
-    graphics->DrawTriangle(texture,
-                           x,       y,        c,
-                           x,       y+height, c,
-                           x+width, y+height, c);
+    Rectangle rectangle = {x, y, width, height, c};
+    graphics->DrawRectangles(texture, &rectangle, 1);
     return;
 }
 
 void ImageHandle::DrawCircle(float cx, float cy, float radius, const Color& c) const
 {
-    if (radius < 0)
-        radius = -radius;
-
-    double xOld;
-    double yOld;
-    double xNew = cx;
-    double yNew = static_cast<double>(cy)-radius;
-
-    // Rough heuristic to determine the resolution of the circle.
-    long numSegments = static_cast<long>(6*sqrt(radius));
-    if (numSegments < 12)
-        numSegments = 12;
-
-    for (long n=numSegments-1; n>=0; n--)
-    {
-        xOld = xNew;
-        yOld = yNew;
-        xNew = cx-radius*sin(2*PI*n/numSegments);
-        yNew = cy-radius*cos(2*PI*n/numSegments);
-
-        graphics->DrawTriangle(texture,
-            static_cast<float>(cx),   static_cast<float>(cy),   c,
-            static_cast<float>(xOld), static_cast<float>(yOld), c,
-            static_cast<float>(xNew), static_cast<float>(yNew), c);
-    }
-
+    graphics->DrawCapsule(texture, cx, cy, cx, cy, radius, c);
     return;
 }
 
-void ImageHandle::DrawLine(float x1, float y1, float x2, float y2, 
+void ImageHandle::DrawLine(float x1, float y1, float x2, float y2,
                            float thickness, const Color& c) const
 {
-    if (thickness < 0)
-        thickness = -thickness;
-
-    //Calculate perpendicular vector.
-    double vx = static_cast<double>(y2)-y1;
-    double vy = static_cast<double>(x1)-x2;
-    double n = sqrt(vx*vx+vy*vy);
+    // The line has rounded ends.
+    graphics->DrawCapsule(texture, x1, y1, x2, y2, thickness/2, c);
+    return;
+}
 
-    if (n < 0.01)
-    {
-        // Too close together.
-        DrawCircle(x1, y1, thickness/2, c);
-        return;
-    }
+void ImageHandle::DrawRectangles(const Rectangle* rectangles, size_t size) const
+{
+    graphics->DrawRectangles(texture, rectangles, size);
+    return;
+}
 
-    // Change the length of the vector to be thickness/2.
-    vx *= thickness/(2*n);
-    vy *= thickness/(2*n);
+void ImageHandle::DrawPolyline(const Point* points, size_t size,
+                               float thickness, const Color& c) const
+{
+    graphics->DrawCapsules(texture, points, size, thickness/2, c);
+    return;
+}
 
-    // Draw the main body of the line.
-    graphics->DrawTriangle(texture,
-        static_cast<float>(x1+vx), static_cast<float>(y1+vy), c,
-        static_cast<float>(x1-vx), static_cast<float>(y1-vy), c,
-        static_cast<float>(x2+vx), static_cast<float>(y2+vy), c);
+void ImageHandle::DrawTriangleMesh(const Point* vertices, const Color* colors, size_t numVertices,
+                                   const uint32_t* indices, size_t numIndices) const
+{
+    graphics->DrawTriangles(texture, vertices, colors, numVertices, indices, numIndices);
+    return;
+}
 
-    graphics->DrawTriangle(texture,
-        static_cast<float>(x2-vx), static_cast<float>(y2-vy), c,
-        static_cast<float>(x1-vx), static_cast<float>(y1-vy), c,
-        static_cast<float>(x2+vx), static_cast<float>(y2+vy), c);
-
-    // Draw circular end caps.
-
-    // We still draw a full circle but sometimes the sectors are centered at (x1, y1),
-    // and sometimes they are centered at (x2, y2).
-    double radius = thickness/2;
-    double xOld;
-    double yOld;
-    long   sideOld;
-    double xNew =  0;
-    double yNew = -1;
-    long   sideNew = (vx>0)?1:2;
-
-    // Rough heuristic to determine the resolution of the circle.
-    long numSegments = static_cast<long>(6*sqrt(radius));
-    if (numSegments < 12)
-        numSegments = 12;
-
-    for (long n=numSegments-1; n>=0; n--)
-    {
-        xOld = xNew;
-        yOld = yNew;
-        sideOld = sideNew;
-
-        xNew = -sin(2*PI*n/numSegments);
-        yNew = -cos(2*PI*n/numSegments);
-        sideNew = (xNew*vy-yNew*vx>0)?1:2;
-
-        if (sideNew==1 && sideOld==1)
-        {
-            graphics->DrawTriangle(texture,
-                static_cast<float>(x1),             static_cast<float>(y1),             c,
-                static_cast<float>(x1+radius*xOld), static_cast<float>(y1+radius*yOld), c,
-                static_cast<float>(x1+radius*xNew), static_cast<float>(y1+radius*yNew), c);
-        }
-
-        if (sideNew==1 && sideOld==2)
-        {
-            graphics->DrawTriangle(texture,
-                static_cast<float>(x1),             static_cast<float>(y1),             c,
-                static_cast<float>(x1-vx),          static_cast<float>(y1-vy),          c,
-                static_cast<float>(x1+radius*xNew), static_cast<float>(y1+radius*yNew), c);
-
-            graphics->DrawTriangle(texture,
-                static_cast<float>(x2),             static_cast<float>(y2),             c,
-                static_cast<float>(x2-vx),          static_cast<float>(y2-vy),          c,
-                static_cast<float>(x2+radius*xOld), static_cast<float>(y2+radius*yOld), c);
-        }
-
-        if (sideNew==2 && sideOld==1)
-        {
-            graphics->DrawTriangle(texture,
-                static_cast<float>(x1),             static_cast<float>(y1),             c,
-                static_cast<float>(x1+vx),          static_cast<float>(y1+vy),          c,
-                static_cast<float>(x1+radius*xOld), static_cast<float>(y1+radius*yOld), c);
-
-            graphics->DrawTriangle(texture,
-                static_cast<float>(x2),             static_cast<float>(y2),             c,
-                static_cast<float>(x2+vx),          static_cast<float>(y2+vy),          c,
-                static_cast<float>(x2+radius*xNew), static_cast<float>(y2+radius*yNew), c);
-        }
-        
-        if (sideNew==2 && sideOld==2)
-        {
-            graphics->DrawTriangle(texture,
-                static_cast<float>(x2),             static_cast<float>(y2),             c,
-                static_cast<float>(x2+radius*xOld), static_cast<float>(y2+radius*yOld), c,
-                static_cast<float>(x2+radius*xNew), static_cast<float>(y2+radius*yNew), c);
-        }
-    }
+void ImageHandle::DrawTriangleMesh(const vector<Point>& vertices,
+                                   const vector<Color>& colors,
+                                   const vector<uint32_t>& indices) const
+{
+    if (colors.size() != vertices.size())
+        throw error("Triangle mesh needs a color for each vertex");
 
+    DrawTriangleMesh(vertices.data(), colors.data(), vertices.size(),
+                     indices.data(), indices.size());
     return;
 }
 
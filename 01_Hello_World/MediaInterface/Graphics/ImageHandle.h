@@ -37,6 +37,11 @@ public:
 
     void Clear(const Color& c) const;
 
+    // Limits drawing on this image (but not Clear()) to the rectangle, within any clip rectangle
+    // already pushed. Drawing entirely outside it is skipped, so e.g. off screen tiles are cheap.
+    void PushClipRect(std::int32_t x, std::int32_t y, std::int32_t width, std::int32_t height) const;
+    void PopClipRect() const;
+
     // Same as calling DrawScaledImage with destW, destH, maskW, maskH given by srcW, srcH.  
     void DrawImage(float destX, float destY,
                    const ImageHandle& srcImg,
@@ -64,6 +69,32 @@ public:
                          float maskX = 0, float maskY = 0, float maskW = 0, float maskH = 0,
                          const ImageHandle* pPaletteImg = nullptr,
                          float paletteX = 0, float paletteY = 0, float paletteW = 0) const;
+    // Draws a paletted image (see MediaInterface::CreateImage) using a row of the palette store
+    // (see MediaInterface::SetPaletteRow), so changing palettes doesn't use the image cache.
+    void DrawPalettedImage(float destX, float destY,
+                           const ImageHandle& srcImg,
+                           float srcX,  float srcY,  float srcW,  float srcH,
+                           std::uint32_t paletteRow,
+                           float alpha = 255,
+                           const ImageHandle* pMaskImg = nullptr,
+                           float maskX = 0, float maskY = 0) const
+    {
+        DrawScaledPalettedImage(destX, destY, srcW, srcH,
+                                srcImg,
+                                srcX, srcY, srcW, srcH,
+                                paletteRow,
+                                alpha,
+                                pMaskImg,
+                                maskX, maskY, srcW, srcH);
+    }
+    void DrawScaledPalettedImage(float destX, float destY, float destW, float destH,
+                                 const ImageHandle& srcImg,
+                                 float srcX,  float srcY,  float srcW,  float srcH,
+                                 std::uint32_t paletteRow,
+                                 float alpha = 255,
+                                 const ImageHandle* pMaskImg = nullptr,
+                                 float maskX = 0, float maskY = 0,
+                                 float maskW = 0, float maskH = 0) const;
     void DrawTriangle(float x1, float y1, const Color& c1,
                       float x2, float y2, const Color& c2,
                       float x3, float y3, const Color& c3) const;
@@ -75,6 +106,21 @@ public:
     void DrawCircle(float cx, float cy, float radius, const Color& c) const;
     void DrawLine(float x1, float y1, float x2, float y2, float thickness, const Color& c) const;
 
+    // These draw many shapes at once, which is much faster than a call for each.
+    void DrawRectangles(const Rectangle* rectangles, size_t size) const;
+    void DrawRectangles(const std::vector<Rectangle>& rectangles) const
+        { DrawRectangles(rectangles.data(), rectangles.size()); }
+    // Lines (with rounded ends) joining consecutive points. Overlaps are drawn twice, so the joins
+    // show if the color is translucent.
+    void DrawPolyline(const Point* points, size_t size, float thickness, const Color& c) const;
+    void DrawPolyline(const std::vector<Point>& points, float thickness, const Color& c) const
+        { DrawPolyline(points.data(), points.size(), thickness, c); }
+    // A triangle for every 3 indices into vertices, each vertex has the color at the same index.
+    void DrawTriangleMesh(const Point* vertices, const Color* colors, size_t numVertices,
+                          const std::uint32_t* indices, size_t numIndices) const;
+    void DrawTriangleMesh(const std::vector<Point>& vertices, const std::vector<Color>& colors,
+                          const std::vector<std::uint32_t>& indices) const;
+
 
 
     // Helper functions to avoid conversion warnings.
@@ -142,6 +188,31 @@ public:
                         static_cast<float>(paletteW));
     }
 
+    template<std::convertible_to<float> DX,         std::convertible_to<float> DY,
+             std::convertible_to<float> SX,         std::convertible_to<float> SY,
+             std::convertible_to<float> SW,         std::convertible_to<float> SH,
+             std::convertible_to<float> A  = float,
+             std::convertible_to<float> MX = float, std::convertible_to<float> MY = float>
+    void DrawPalettedImage(DX destX, DY destY,
+                           const ImageHandle& srcImg,
+                           SX srcX,  SY srcY,  SW srcW,  SH srcH,
+                           std::uint32_t paletteRow,
+                           A alpha = 255,
+                           const ImageHandle* pMaskImg = nullptr,
+                           MX maskX = 0, MY maskY = 0) const
+    {
+        const ImageHandle& temp = *this; // Workaround for compiler bug.
+        temp.                            // Workaround for compiler bug.
+        DrawPalettedImage(static_cast<float>(destX), static_cast<float>(destY),
+                          srcImg,
+                          static_cast<float>(srcX),  static_cast<float>(srcY),
+                          static_cast<float>(srcW),  static_cast<float>(srcH),
+                          paletteRow,
+                          static_cast<float>(alpha),
+                          pMaskImg,
+                          static_cast<float>(maskX), static_cast<float>(maskY));
+    }
+
     void DrawTriangle(std::convertible_to<float> auto x1, std::convertible_to<float> auto y1,
                       const Color& c1,
                       std::convertible_to<float> auto x2, std::convertible_to<float> auto y2, 
@@ -213,6 +284,7 @@ private:
     bool          smooth;
 
     friend class MediaInterface;
+    friend class CommandBuffer;
 };
 
 } // End of namespace mi.
\ No newline at end of file
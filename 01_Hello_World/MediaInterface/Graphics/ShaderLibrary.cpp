@@ -1,4 +1,37 @@
 #include "ShaderLibrary.h"
+#include <cstdint>
+#include <string>
+
+namespace
+{
+
+// Declares the samplers tex1, ..., texN.
+std::string Samplers(std::uint32_t numTextures)
+{
+    std::string source;
+
+    for (std::uint32_t i=1; i<=numTextures; i++)
+        source += "uniform sampler2D tex"+std::to_string(i)+";\n";
+
+    return source;
+}
+
+// The cases of a switch on the texture unit, returning before+N+after for texN.
+std::string SamplerCases(std::uint32_t numTextures, const std::string& before,
+                         const std::string& after)
+{
+    std::string source;
+
+    for (std::uint32_t i=1; i<=numTextures; i++)
+    {
+        std::string n = std::to_string(i);
+        source += "case "+n+": return "+before+n+after+";\n";
+    }
+
+    return source;
+}
+
+} // End of anonymous namespace.
 
 namespace mi
 {
@@ -38,7 +71,9 @@ const std::string blitToImage =
 "    texPos = tPos;                      "
 "}                                       ";
 
-const std::string drawToImage =
+std::string DrawToImage(std::uint32_t numTextures)
+{
+    return
 "#version 330                                              \n"
 "                                                            "
 "layout (location = 0) in vec2  pPos;                        "
@@ -53,14 +88,9 @@ const std::string drawToImage =
 "uniform int outputWidth;                                    "
 "uniform int outputHeight;                                   "
 "                                                            "
-"uniform sampler2D tex1;                                     "
-"uniform sampler2D tex2;                                     "
-"uniform sampler2D tex3;                                     "
-"uniform sampler2D tex4;                                     "
-"uniform sampler2D tex5;                                     "
-"uniform sampler2D tex6;                                     "
-"uniform sampler2D tex7;                                     "
-"uniform sampler2D tex8;                                     "
++ Samplers(numTextures) +
+"uniform sampler2D paletteStore;                             "
+"uniform int       paletteStoreUnit;                         "
 "                                                            "
 "flat out float vType;                                       "
 "     out vec4  vCol;                                        "
@@ -71,6 +101,19 @@ const std::string drawToImage =
 "flat out float vPaletteWidth;                               "
 "flat out vec2  vPaletteTexDim;                              "
 "                                                            "
+"ivec2 TextureSize(int unit, ivec2 none)                     "
+"{                                                           "
+"    if (unit == paletteStoreUnit)                           "
+"        return textureSize(paletteStore, 0);                "
+"                                                            "
+"    switch (unit)                                           "
+"    {                                                       "
++ SamplerCases(numTextures, "textureSize(tex", ", 0)") +
+"    }                                                       "
+"                                                            "
+"    return none;                                            "
+"}                                                           "
+"                                                            "
 "void main()                                                 "
 "{                                                           "
 "    gl_Position = vec4(2.0*(pPos.x/float(outputWidth))-1.0, "
@@ -85,16 +128,7 @@ const std::string drawToImage =
 "    ivec2 dim;                                              "
 "                                                            "
 "    type = int(pType+0.5);                                  "
-"                                                            "
-"    dim = int(type==0) * ivec2(255, 255)                    "
-"        + int(type==1) * textureSize(tex1, 0)               "
-"        + int(type==2) * textureSize(tex2, 0)               "
-"        + int(type==3) * textureSize(tex3, 0)               "
-"        + int(type==4) * textureSize(tex4, 0)               "
-"        + int(type==5) * textureSize(tex5, 0)               "
-"        + int(type==6) * textureSize(tex6, 0)               "
-"        + int(type==7) * textureSize(tex7, 0)               "
-"        + int(type==8) * textureSize(tex8, 0);              "
+"    dim  = TextureSize(type, ivec2(255, 255));              "
 "                                                            "
 "    vCol.r = pCol.r/float(dim.x);                           "
 "    vCol.g = pCol.g/float(dim.y);                           "
@@ -102,16 +136,7 @@ const std::string drawToImage =
 "    vCol.a = pCol.a/255.0;                                  "
 "                                                            "
 "    type = int(pMaskType+0.5);                              "
-"                                                            "
-"    dim = int(type==0) * ivec2(1, 1)                        "
-"        + int(type==1) * textureSize(tex1, 0)               "
-"        + int(type==2) * textureSize(tex2, 0)               "
-"        + int(type==3) * textureSize(tex3, 0)               "
-"        + int(type==4) * textureSize(tex4, 0)               "
-"        + int(type==5) * textureSize(tex5, 0)               "
-"        + int(type==6) * textureSize(tex6, 0)               "
-"        + int(type==7) * textureSize(tex7, 0)               "
-"        + int(type==8) * textureSize(tex8, 0);              "
+"    dim  = TextureSize(type, ivec2(1, 1));                  "
 "                                                            "
 "    vMaskPos.x = pMaskPos.x/float(dim.x);                   "
 "    vMaskPos.y = pMaskPos.y/float(dim.y);                   "
@@ -120,16 +145,7 @@ const std::string drawToImage =
 "    vPalettePos   = pPalettePos;                            "
 "                                                            "
 "    type = int(pPaletteType+0.5);                           "
-"                                                            "
-"    dim = int(type==0) * ivec2(1, 1)                        "
-"        + int(type==1) * textureSize(tex1, 0)               "
-"        + int(type==2) * textureSize(tex2, 0)               "
-"        + int(type==3) * textureSize(tex3, 0)               "
-"        + int(type==4) * textureSize(tex4, 0)               "
-"        + int(type==5) * textureSize(tex5, 0)               "
-"        + int(type==6) * textureSize(tex6, 0)               "
-"        + int(type==7) * textureSize(tex7, 0)               "
-"        + int(type==8) * textureSize(tex8, 0);              "
+"    dim  = TextureSize(type, ivec2(1, 1));                  "
 "                                                            "
 "    vPaletteTexDim = vec2(dim);                             "
 "                                                            "
@@ -138,6 +154,7 @@ const std::string drawToImage =
 "    vPaletteWidth = float(dontDefault)*pPaletteWidth        "
 "                  + float(1-dontDefault)*1.0;               "
 "}                                                           ";
+}
 
 } // End of namespace mi::shader::vertex.
 
@@ -202,7 +219,45 @@ const std::string addAlpha =
 "    fragColor = vec4(c.rgb*a.r, a.r);  "
 "}                                      ";
 
-const std::string drawToImage =
+const std::string createPaletted =
+"#version 330                                                      \n"
+"                                                                    "
+"out vec4 fragColor;                                                 "
+"                                                                    "
+"uniform sampler2D tex;                                              "
+"uniform sampler2D palette;                                          "
+"uniform ivec4 paletteRect;                                          "
+"                                                                    "
+"void main()                                                         "
+"{                                                                   "
+"    ivec4 c = ivec4(texelFetch(tex, ivec2(gl_FragCoord.xy), 0)      "
+"                    *255.0+0.5);                                    "
+"                                                                    "
+"    int index     = 0;                                              "
+"    int numColors = paletteRect.z*paletteRect.w;                    "
+"                                                                    "
+"    for (int i=0; i<numColors; i++)                                 "
+"    {                                                               "
+"        ivec2 pos = paletteRect.xy + ivec2(i % paletteRect.z,       "
+"                                           i / paletteRect.z);      "
+"        ivec4 p   = ivec4(texelFetch(palette, pos, 0)*255.0+0.5);   "
+"                                                                    "
+"        if (p == c)                                                 "
+"        {                                                           "
+"            index = i;                                              "
+"            break;                                                  "
+"        }                                                           "
+"    }                                                               "
+"                                                                    "
+"    fragColor = vec4(float((index/65536)%256)/255.0,                "
+"                     float((index/256)%256)/255.0,                  "
+"                     float(index%256)/255.0,                        "
+"                     1.0);                                          "
+"}                                                                   ";
+
+std::string DrawToImage(std::uint32_t numTextures)
+{
+    return
 "#version 330                                             \n"
 "                                                           "
 "flat in float vType;                                       "
@@ -214,30 +269,30 @@ const std::string drawToImage =
 "flat in float vPaletteWidth;                               "
 "flat in vec2  vPaletteTexDim;                              "
 "                                                           "
-"uniform sampler2D tex1;                                    "
-"uniform sampler2D tex2;                                    "
-"uniform sampler2D tex3;                                    "
-"uniform sampler2D tex4;                                    "
-"uniform sampler2D tex5;                                    "
-"uniform sampler2D tex6;                                    "
-"uniform sampler2D tex7;                                    "
-"uniform sampler2D tex8;                                    "
++ Samplers(numTextures) +
+"uniform sampler2D paletteStore;                            "
+"uniform int       paletteStoreUnit;                        "
 "                                                           "
 "out vec4 fragColor;                                        "
 "                                                           "
+"vec4 Sample(int unit, vec2 pos, vec4 none)                 "
+"{                                                          "
+"    if (unit == paletteStoreUnit)                          "
+"        return texture(paletteStore, pos);                 "
+"                                                           "
+"    switch (unit)                                          "
+"    {                                                      "
++ SamplerCases(numTextures, "texture(tex", ", pos)") +
+"    }                                                      "
+"                                                           "
+"    return none;                                           "
+"}                                                          "
+"                                                           "
 "void main()                                                "
 "{                                                          "
 "    int type = int(vType+0.5);                             "
 "                                                           "
-"    vec4 color = float(type==0) * vec4(vCol.rgb, 1)        "
-"               + float(type==1) * texture(tex1, vCol.xy)   "
-"               + float(type==2) * texture(tex2, vCol.xy)   "
-"               + float(type==3) * texture(tex3, vCol.xy)   "
-"               + float(type==4) * texture(tex4, vCol.xy)   "
-"               + float(type==5) * texture(tex5, vCol.xy)   "
-"               + float(type==6) * texture(tex6, vCol.xy)   "
-"               + float(type==7) * texture(tex7, vCol.xy)   "
-"               + float(type==8) * texture(tex8, vCol.xy);  "
+"    vec4 color = Sample(type, vCol.xy, vec4(vCol.rgb, 1)); "
 "                                                           "
 "    type = int(vPaletteType+0.5);                          "
 "                                                           "
@@ -254,31 +309,22 @@ const std::string drawToImage =
 "                   + float(paletteIndex / paletteWidth))   "
 "                   / vPaletteTexDim.y;                     "
 "                                                           "
-"    fragColor = float(type==0) * color                     "
-"              + float(type==1) * texture(tex1, palettePos) "
-"              + float(type==2) * texture(tex2, palettePos) "
-"              + float(type==3) * texture(tex3, palettePos) "
-"              + float(type==4) * texture(tex4, palettePos) "
-"              + float(type==5) * texture(tex5, palettePos) "
-"              + float(type==6) * texture(tex6, palettePos) "
-"              + float(type==7) * texture(tex7, palettePos) "
-"              + float(type==8) * texture(tex8, palettePos);"
+"    fragColor = Sample(type, palettePos, color);           "
 "                                                           "
-"    float maskAlpha;                                       "
 "    type = int(vMaskType+0.5);                             "
 "                                                           "
-"    maskAlpha = float(type==0) * 1.0                       "
-"              + float(type==1) * texture(tex1, vMaskPos).r "
-"              + float(type==2) * texture(tex2, vMaskPos).r "
-"              + float(type==3) * texture(tex3, vMaskPos).r "
-"              + float(type==4) * texture(tex4, vMaskPos).r "
-"              + float(type==5) * texture(tex5, vMaskPos).r "
-"              + float(type==6) * texture(tex6, vMaskPos).r "
-"              + float(type==7) * texture(tex7, vMaskPos).r "
-"              + float(type==8) * texture(tex8, vMaskPos).r;"
+"    float maskAlpha = Sample(type, vMaskPos, vec4(1.0)).r; "
 "                                                           "
 "    fragColor *= vCol.a * maskAlpha;                       "
+"                                                           "
+"    if (vType < -0.5)                                      "
+"    {                                                      "
+"        float dx = max(abs(vMaskPos.x)-vPalettePos.x, 0.0);"
+"        float d  = length(vec2(dx, vMaskPos.y));           "
+"        fragColor *= clamp(vPalettePos.y+0.5-d, 0.0, 1.0); "
+"    }                                                      "
 "}                                                          ";
+}
 
 } // End of namespace mi::shader::fragment.
 
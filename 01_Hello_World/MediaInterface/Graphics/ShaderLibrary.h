@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
 
 namespace mi
@@ -15,7 +16,8 @@ namespace vertex
 // blitToScreen flips the y position, so it renders correctly on the screen.
 extern const std::string blitToScreen;
 extern const std::string blitToImage;
-extern const std::string drawToImage;
+// Generated for numTextures cached textures (the samplers tex1, ..., texN).
+std::string DrawToImage(std::uint32_t numTextures);
 } // End of namespace mi::shader::vertex.
 
 namespace fragment
@@ -23,7 +25,12 @@ namespace fragment
 extern const std::string blitToScreen;
 extern const std::string createMask;
 extern const std::string addAlpha;
-extern const std::string drawToImage;
+// Replaces each pixel of tex with the index (in RGB) of the first matching color in the
+// paletteRect (x, y, width, height) of palette, or 0 if there's no match. The output must be the
+// same size as tex.
+extern const std::string createPaletted;
+// Generated for numTextures cached textures (the samplers tex1, ..., texN).
+std::string DrawToImage(std::uint32_t numTextures);
 } // End of namespace mi::shader::fragment.
 
 } // End of namespace mi::shader.
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "Color.h"
+
+namespace mi
+{
+
+// Used to draw many shapes with one call (see ImageHandle).
+class Point
+{
+public:
+    float x;
+    float y;
+};
+
+class Rectangle
+{
+public:
+    float x;
+    float y;
+    float width;
+    float height;
+    Color c;
+};
+
+} // End of namespace mi.
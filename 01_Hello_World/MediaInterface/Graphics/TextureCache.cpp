@@ -1,20 +1,19 @@
 #include "TextureCache.h"
 #include "Graphics.h"
+#include <algorithm>
 #include <cstdint>
-#include <unordered_map>
 #include <vector>
 #include <stdexcept>
 #include <iostream>
 
 using error = std::runtime_error;
 using std::uint32_t;
-using std::unordered_map;
 using std::vector;
 
 namespace mi
 {
 
-TextureCache::TextureCache() : g{nullptr}, placeholderTexture{0}
+TextureCache::TextureCache() : placeholderTexture{0}, g{nullptr}
 {
 }
 
@@ -41,6 +40,8 @@ void TextureCache::Init(Graphics* g, uint32_t size)
     // Fill in the cache data.
     oldest = 0;
     newest = 0;
+    batch  = 0;
+    slots.assign(size+1, Slot());
 
     // Texture unit 0 is reserved for screen blitting.
     // Fill units 1, ..., size with the placeholder image.
@@ -55,8 +56,18 @@ void TextureCache::Init(Graphics* g, uint32_t size)
 
 void TextureCache::Free()
 {
-    order.clear();
+    oldest = 0;
+    newest = 0;
+    slots.clear();
+    units.clear();
     unused.clear();
+    trace.clear();
+    lastTrace.clear();
+    generations.clear();
+    nextUses.clear();
+    predictedUses.clear();
+    lastAdded = 0;
+    cursor    = 0;
 
     if (g)
         g->DeleteTexture(placeholderTexture);
@@ -69,161 +80,277 @@ void TextureCache::Free()
 
 void TextureCache::Add(const std::uint32_t* textures, size_t size)
 {
-    unordered_map<uint32_t, CacheData>::iterator it;
-    CacheData data;
-    
+    // Most draws use the same texture as the last one.
+    if (size == 1 && textures[0] == lastAdded && GetTextureUnit(textures[0]) != 0)
+        return;
+
+    batch++;
+
     // Check if the texture is already there first.
     for (size_t i=0; i<size; i++)
     {
-        it = order.find(textures[i]);
-        if (it == order.end())
-            continue; // Not in the map "order".
+        Record(textures[i]);
 
-        if (textures[i] == newest)
-            continue; // Already the newest.
+        uint32_t unit = GetTextureUnit(textures[i]);
+        if (unit == 0)
+            continue; // Not cached.
 
-        // Remove textures[i] from the order.
-        if (it->second.older == 0)
-        {
-            oldest = it->second.newer;
-            order[oldest].older = 0;
-        }
-        else
+        slots[unit].batch = batch;
+
+        if (unit != newest)
         {
-            order[it->second.older].newer = it->second.newer;
-            order[it->second.newer].older = it->second.older;
+            Unlink(unit);
+            MakeNewest(unit);
         }
-
-        // Add textures[i] back as the newest texture.
-        order[newest].newer      = textures[i];
-        order[textures[i]].older = newest;
-        order[textures[i]].newer = 0;
-        newest                   = textures[i];
     }
 
-    // Go through the textures taking any free slots or replacing the oldest texture.
+    // Go through the textures taking any free slots or replacing others.
     for (size_t i=0; i<size; i++)
     {
-        if (order.find(textures[i]) != order.end())
-            continue; // Already in the map "order".
+        if (GetTextureUnit(textures[i]) == 0)
+            Load(textures[i]);
+    }
 
-        // Check if there is an unused slot.
-        if (unused.size() != 0)
-        {
-            // Use an unused slot.
-            data.textureUnit = unused.back();
-
-            // Add texture to texture unit.
-            g->UseTextureUnit(data.textureUnit);
-            g->UseTexture(data.textureUnit, textures[i]);
-            
-            unused.pop_back();
-        }
-        else
-        {
-            // No unused slots.
+    if (size != 0)
+        lastAdded = textures[size-1];
 
-            // Flush drawing before replacing the textures.
-            g->FlushRenderData();
+    return;
+}
 
-            // Use the oldest textureUnit.
-            data.textureUnit = order[oldest].textureUnit;
+void TextureCache::EndFrame()
+{
+    // Forget the last frame's predictions.
+    for (const TraceEntry& entry : lastTrace)
+    {
+        if (IsCurrent(entry))
+            predictedUses[entry.texture] = noUse;
+    }
 
-            // Add texture to texture unit.
-            g->UseTextureUnit(data.textureUnit);
-            g->UseTexture(data.textureUnit, textures[i]);
+    lastTrace.swap(trace);
+    trace.clear();
+    lastAdded = 0;
+    cursor    = 0;
 
-            // Determine the new oldest and update order.
-            uint32_t prevOldest = oldest;
-            oldest = order[prevOldest].newer;
-            
-            if (oldest == 0)
-                newest = 0;
-            else
-                order[oldest].older = 0;
+    // Link each use to the next use of the same texture, going backwards so predictedUses ends
+    // up with the first.
+    nextUses.resize(lastTrace.size());
 
-            order.erase(prevOldest);
-        }
+    for (size_t i=lastTrace.size(); i-- > 0;)
+    {
+        if (!IsCurrent(lastTrace[i]))
+            continue; // Removed.
 
-        // Update order and newest.
-        data.newer = 0;
-        data.older = newest;
-        order[textures[i]] = data;
-        
-        if (newest == 0)
-            oldest = textures[i];
-        else
-            order[newest].newer = textures[i];
+        uint32_t texture = lastTrace[i].texture;
+
+        if (texture >= predictedUses.size())
+            predictedUses.resize(texture+1, noUse);
 
-        newest = textures[i];
+        nextUses[i]            = predictedUses[texture];
+        predictedUses[texture] = static_cast<uint32_t>(i);
+    }
+
+    // Load the textures in the order the next frame is predicted to use them, until the cache is
+    // full of textures needed before any of the rest.
+    batch++;
+
+    for (const TraceEntry& entry : lastTrace)
+    {
+        if (!IsCurrent(entry))
+            continue;
+
+        uint32_t texture = entry.texture;
+        uint32_t unit = GetTextureUnit(texture);
+
+        if (unit != 0)
+            slots[unit].batch = batch;
+        else if (unused.size() != 0 || FindReplacement() != 0)
+            Load(texture);
+        else
+            break;
     }
 
     return;
 }
 
-void TextureCache::Remove(uint32_t texture)
+void TextureCache::Record(uint32_t texture)
 {
-    auto it = order.find(texture);
-    if (it == order.end())
-        return; // Not in the map "order".
+    if (texture >= generations.size())
+        generations.resize(texture+1, 0);
 
-    // Flush drawing before removing the texture.
-    g->FlushRenderData();
+    TraceEntry entry = {texture, generations[texture]};
 
-    // Replace texture with placeholder.
-    g->UseTextureUnit(it->second.textureUnit);
-    g->UseTexture(it->second.textureUnit, placeholderTexture);
+    if (!trace.empty() && trace.back().texture == texture &&
+        trace.back().generation == entry.generation)
+        return;
 
-    unused.push_back(it->second.textureUnit);
+    if (trace.size() < maxTraceSize)
+        trace.push_back(entry);
 
-    // Remove texture from the order.
-    if (it->second.newer == 0)
+    // Find where this frame is in the last one, assuming it mostly repeats it.
+    uint32_t use = PredictedUse(texture);
+
+    if (use == noUse)
+        return; // Not drawn (again) last frame.
+
+    if (use-cursor <= maxSkip)
     {
-        if (it->second.older == 0)
-        {
-            oldest = 0;
-            newest = 0;
-        }
-        else
-        {
-            newest = it->second.older;
-            order[newest].newer = 0;
-        }
+        // The draws in between were dropped from this frame.
+        while (cursor <= use)
+            UsePrediction(cursor++);
     }
     else
+        UsePrediction(use); // Drawn out of order.
+
+    return;
+}
+
+void TextureCache::UsePrediction(size_t i)
+{
+    // Only move on the texture's prediction if it is this use (it may already be past it).
+    if (IsCurrent(lastTrace[i]) && predictedUses[lastTrace[i].texture] == i)
+        predictedUses[lastTrace[i].texture] = nextUses[i];
+
+    return;
+}
+
+void TextureCache::Load(uint32_t texture)
+{
+    uint32_t unit;
+
+    // Check if there is an unused slot.
+    if (unused.size() != 0)
     {
-        if (it->second.older == 0)
-        {
-            oldest = it->second.newer;
-            order[oldest].older = 0;
-        }
-        else
+        // Use an unused slot.
+        unit = unused.back();
+        unused.pop_back();
+    }
+    else
+    {
+        // No unused slots.
+
+        // Flush drawing before replacing the textures.
+        g->FlushRenderData();
+
+        unit = FindReplacement();
+        if (unit == 0)
+            unit = oldest; // More textures in the batch than units.
+
+        units[slots[unit].texture] = 0;
+        Unlink(unit);
+    }
+
+    // Add texture to texture unit.
+    g->UseTextureUnit(unit);
+    g->UseTexture(unit, texture);
+
+    if (texture >= units.size())
+        units.resize(texture+1, 0);
+
+    units[texture]      = unit;
+    slots[unit].texture = texture;
+    slots[unit].batch   = batch;
+    MakeNewest(unit);
+    return;
+}
+
+uint32_t TextureCache::FindReplacement() const
+{
+    uint32_t replacement = 0;
+    uint32_t furthestUse = 0;
+
+    for (uint32_t unit=oldest; unit!=0; unit=slots[unit].newer)
+    {
+        if (slots[unit].batch == batch)
+            continue;
+
+        uint32_t use = PredictedUse(slots[unit].texture);
+
+        if (replacement == 0 || use > furthestUse)
         {
-            order[it->second.older].newer = it->second.newer;
-            order[it->second.newer].older = it->second.older;
+            replacement = unit;
+            furthestUse = use;
         }
     }
 
-    order.erase(texture);
+    return replacement;
+}
+
+void TextureCache::Remove(uint32_t texture)
+{
+    // The texture's name may be reused, so its entries in the traces are no longer current.
+    if (texture < generations.size())
+        generations[texture]++;
+
+    if (texture < predictedUses.size())
+        predictedUses[texture] = noUse;
+
+    if (texture == lastAdded)
+        lastAdded = 0;
+
+    uint32_t unit = GetTextureUnit(texture);
+    if (unit != 0)
+        Evict(unit);
+
     return;
 }
 
 void TextureCache::RemoveAll()
 {
     while(newest != 0)
-        Remove(newest);
+        Evict(newest);
+
+    return;
+}
+
+void TextureCache::Evict(uint32_t unit)
+{
+    // Flush drawing before removing the texture.
+    g->FlushRenderData();
+
+    // Replace texture with placeholder.
+    g->UseTextureUnit(unit);
+    g->UseTexture(unit, placeholderTexture);
+
+    unused.push_back(unit);
 
+    // Remove texture from the order.
+    Unlink(unit);
+    units[slots[unit].texture] = 0;
+    slots[unit].texture        = 0;
     return;
 }
 
-uint32_t TextureCache::GetTextureUnit(uint32_t texture)
+void TextureCache::Unlink(uint32_t unit)
 {
-    auto it = order.find(texture);
+    Slot& slot = slots[unit];
+
+    if (slot.older == 0)
+        oldest = slot.newer;
+    else
+        slots[slot.older].newer = slot.newer;
 
-    if (it == order.end())
-        return 0;
+    if (slot.newer == 0)
+        newest = slot.older;
+    else
+        slots[slot.newer].older = slot.older;
 
-    return it->second.textureUnit;
+    slot.older = 0;
+    slot.newer = 0;
+    return;
+}
+
+void TextureCache::MakeNewest(uint32_t unit)
+{
+    slots[unit].older = newest;
+    slots[unit].newer = 0;
+
+    if (newest == 0)
+        oldest = unit;
+    else
+        slots[newest].newer = unit;
+
+    newest = unit;
+    return;
 }
 
 void TextureCache::Display()
@@ -236,8 +363,8 @@ void TextureCache::Display()
         uint32_t current = oldest;
         while (current != 0)
         {
-            std::cout << order[current].textureUnit << "(" << current << ") ";
-            current = order[current].newer;
+            std::cout << current << "(" << slots[current].texture << ") ";
+            current = slots[current].newer;
         }
     }
 
@@ -257,4 +384,3 @@ void TextureCache::Display()
 }
 
 } // End of namespace mi.
-
@@ -1,7 +1,7 @@
 #pragma once
 
 #include <cstdint>
-#include <unordered_map>
+#include <cstddef>
 #include <vector>
 
 namespace mi
@@ -19,27 +19,93 @@ public:
     void Init(Graphics* g, std::uint32_t size);
     void Free();
 
-    void Add(const std::uint32_t* textures, size_t size);
+    // The textures are kept cached together (unless there are more than the cache size).
+    void Add(const std::uint32_t* textures, std::size_t size);
+    // For a deleted texture (its name may be reused), also forgets its predicted uses.
     void Remove(std::uint32_t texture);
+    // Empties the cache, keeping the predictions for the next frame.
     void RemoveAll();
 
+    // Call between frames (with no drawing pending). The order textures were added in is used to
+    // predict the next frame: the textures it needs first are loaded now, and while drawing the
+    // texture that will be needed furthest in the future is the one replaced.
+    void EndFrame();
+
     // Returns 0 if not cached.
-    std::uint32_t GetTextureUnit(std::uint32_t texture);
+    std::uint32_t GetTextureUnit(std::uint32_t texture) const
+    {
+        return (texture < units.size()) ? units[texture] : 0;
+    }
 
 private:
-    class CacheData
+    // The least recently used order is a linked list of the texture units, with 0 as the end.
+    class Slot
+    {
+    public:
+        std::uint32_t texture = 0;
+        std::uint32_t older   = 0;
+        std::uint32_t newer   = 0;
+        std::uint32_t batch   = 0; // The last Add() (or prefetch) that used it.
+    };
+
+    void Unlink(std::uint32_t unit);
+    void MakeNewest(std::uint32_t unit);
+    // Replaces the unit's texture with the placeholder, and marks the unit unused.
+    void Evict(std::uint32_t unit);
+
+    // A texture added, with the generation of its name when added.
+    class TraceEntry
     {
     public:
-        std::uint32_t textureUnit;
-        std::uint32_t older;
-        std::uint32_t newer;
+        std::uint32_t texture;
+        std::uint32_t generation;
     };
 
-    std::uint32_t oldest;
-    std::uint32_t newest;
-    std::unordered_map<std::uint32_t, CacheData> order;
+    // False if the texture has been removed since (its name may have been reused).
+    bool IsCurrent(const TraceEntry& entry) const
+    {
+        return entry.texture != 0 && generations[entry.texture] == entry.generation;
+    }
+
+    // Adds the texture to the current trace, and follows it through the last frame's trace.
+    void Record(std::uint32_t texture);
+    // Moves the prediction of the texture at lastTrace[i] on to its next use.
+    void UsePrediction(std::size_t i);
+    // Puts the texture in an unused unit, or replaces the one chosen by FindReplacement().
+    void Load(std::uint32_t texture);
+    // The cached texture (not in the current batch) with the furthest predicted use, with ties
+    // going to the least recently used. Returns 0 if every unit is in the current batch.
+    std::uint32_t FindReplacement() const;
+
+    std::uint32_t PredictedUse(std::uint32_t texture) const
+    {
+        return (texture < predictedUses.size()) ? predictedUses[texture] : noUse;
+    }
+
+    std::uint32_t oldest = 0; // Texture units.
+    std::uint32_t newest = 0;
+    std::uint32_t batch  = 0;
+    std::vector<Slot> slots;          // Indexed by texture unit (unit 0 isn't used).
+    std::vector<std::uint32_t> units; // Indexed by texture (OpenGL names are small integers).
     std::vector<std::uint32_t> unused;
 
+    // The textures added this frame and last frame (repeats in a row are only recorded once).
+    // Removing a texture bumps the generation of its name rather than searching the traces.
+    static constexpr std::uint32_t noUse        = UINT32_MAX;
+    static constexpr std::size_t   maxTraceSize = 1 << 16;
+    std::vector<TraceEntry> trace;
+    std::vector<TraceEntry> lastTrace;
+    std::vector<std::uint32_t> generations;   // Indexed by texture.
+    std::vector<std::uint32_t> nextUses;      // The next index of each lastTrace texture, or noUse.
+    std::vector<std::uint32_t> predictedUses; // Indexed by texture, the next index in lastTrace.
+    std::uint32_t lastAdded = 0; // The last texture added this frame.
+
+    // This frame is matched against lastTrace from the cursor. Textures drawn last frame but not
+    // this one are skipped, up to maxSkip at a time, beyond that a texture is taken to be drawn
+    // out of order. Predictions are never before the cursor.
+    static constexpr std::size_t maxSkip = 16;
+    std::size_t cursor = 0;
+
     std::uint32_t placeholderTexture;
     Graphics* g;
 
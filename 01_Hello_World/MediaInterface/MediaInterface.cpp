@@ -67,13 +67,14 @@ string MediaInterface::SdlGlAttrToString(SDL_GLattr attr)
 }
 
 MediaInterface::MediaInterface(
-    const std::function<std::unique_ptr<Program>(MediaInterface&)>& programCreator)
+    const std::function<std::unique_ptr<Program>(MediaInterface&)>& programCreator,
+    const AudioSettings& audioSettings)
 {
     deleter.mi = this;
     window     = nullptr;
     glContext  = nullptr;
 
-    Init(programCreator);
+    Init(programCreator, audioSettings);
     Run();
     Free();
 
@@ -127,7 +128,8 @@ void MediaInterface::Free()
 }
 
 void MediaInterface::Init(
-    const std::function<std::unique_ptr<Program>(MediaInterface&)>& programCreator)
+    const std::function<std::unique_ptr<Program>(MediaInterface&)>& programCreator,
+    const AudioSettings& audioSettings)
 {
     // Start up SDL, OpenGL, and create a window.
 
@@ -210,7 +212,7 @@ void MediaInterface::Init(
     eventHandler.events.clear();
     
     // Setup the Audio.
-    audio.Init();
+    audio.Init(audioSettings);
 
     // Setup the elapsed time functionality.
     lastCallOfTimeElapsed = std::chrono::steady_clock::now();
@@ -250,14 +252,19 @@ void MediaInterface::DeleteSoundChannel(SoundChannelHandle& soundChannelHandle)
     return;
 }
 
-SoundHandle MediaInterface::CreateSound(const string& filename)
+SoundHandle MediaInterface::CreateSound(const string& filename, SampleStorage storage)
 {
-    return audio.CreateSound(filename);
+    return audio.CreateSound(filename, storage);
 }
 
-SoundHandle MediaInterface::CreateSound(const WavHelper& wavHelper)
+SoundHandle MediaInterface::CreateSound(const WavHelper& wavHelper, SampleStorage storage)
 {
-    return audio.CreateSound(wavHelper);
+    return audio.CreateSound(wavHelper, storage);
+}
+
+SoundHandle MediaInterface::CreateStreamingSound(const string& filename)
+{
+    return audio.CreateStreamingSound(filename);
 }
 
 void MediaInterface::DeleteSound(SoundHandle& soundHandle)
@@ -315,6 +322,14 @@ void MediaInterface::SaveImage(const ImageHandle& imageHandle, const string& fil
     return;
 }
 
+void MediaInterface::DrawCommands(const CommandBuffer* commandBuffers, size_t size)
+{
+    for (size_t i=0; i<size; i++)
+        commandBuffers[i].Draw(graphics);
+
+    return;
+}
+
 void MediaInterface::DisplayInWindow(const ImageHandle& imageHandle)
 {
     graphics.DisplayTexture(imageHandle.texture);
@@ -349,6 +364,19 @@ ImageHandle MediaInterface::CreateImage(const ImageHandle& imageHandle,
                                        paletteX, paletteY, paletteW, paletteH, smooth));
 }
 
+void MediaInterface::SetPaletteRow(uint32_t row, const vector<Color>& colors)
+{
+    graphics.SetPaletteRow(row, colors.data(), colors.size());
+    return;
+}
+
+void MediaInterface::SetPaletteRow(uint32_t row, const ImageHandle& palette,
+                                   uint32_t paletteX, uint32_t paletteY, uint32_t paletteW)
+{
+    graphics.SetPaletteRow(row, palette.texture, paletteX, paletteY, paletteW);
+    return;
+}
+
 void MediaInterface::SetWindowSize(long width, long height)
 {
     SDL_SetWindowSize(window, width, height);
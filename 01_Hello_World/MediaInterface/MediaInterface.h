@@ -2,18 +2,23 @@
 
 #include <SDL.h>
 #include "Graphics/Color.h"
+#include "Graphics/CommandBuffer.h"
 #include "Graphics/ImageHandle.h"
 #include "Graphics/Graphics.h"
 #include "Events/Event.h"
 #include "Audio/Audio.h"
+#include "Audio/AudioEffects.h"
+#include "Audio/AudioSettings.h"
 #include "Audio/SoundChannelHandle.h"
 #include "Audio/SoundHandle.h"
+#include "Audio/SoundStream.h"
 #include "Audio/WavHelper.h"
 #include <string>
 #include <cstdint>
 #include <chrono>
 #include <functional>
 #include <memory>
+#include <vector>
 
 namespace mi
 {
@@ -28,16 +33,40 @@ public:
 class MediaInterface
 {
 public:
+    // The audio settings control the latency of the sound output, e.g. AudioSettings::LowLatency().
     explicit MediaInterface(
-        const std::function<std::unique_ptr<Program>(MediaInterface&)>& programCreator);
+        const std::function<std::unique_ptr<Program>(MediaInterface&)>& programCreator,
+        const AudioSettings& audioSettings = AudioSettings());
     ~MediaInterface();
 
-    // Currently can only load .wav files (16-bit PCM).
-    SoundHandle        CreateSound(const std::string& filename);
-    SoundHandle        CreateSound(const WavHelper& wavHelper);
+    // Currently can only load .wav files (8/16/24/32-bit integer or 32-bit float PCM).
+    SoundHandle        CreateSound(const std::string& filename,
+                                   SampleStorage storage = SampleStorage::Float);
+    SoundHandle        CreateSound(const WavHelper& wavHelper,
+                                   SampleStorage storage = SampleStorage::Float);
+    // For long sounds such as music, the file is read while playing rather than loaded up front.
+    // Only play a streaming sound on one channel at a time.
+    SoundHandle        CreateStreamingSound(const std::string& filename);
     void               DeleteSound(SoundHandle& soundHandle);
     SoundChannelHandle CreateSoundChannel();
     void               DeleteSoundChannel(SoundChannelHandle& soundChannelHandle);
+    // Callback timings and counts of slow callbacks, to help choose the AudioSettings.
+    AudioStats         GetAudioStats() const { return audio.GetStats(); }
+    void               ResetAudioStats() { audio.ResetStats(); }
+    // A monotonic count of the audio frames mixed, used with SoundChannelHandle::PlayAt() and
+    // StopAt(). There are GetAudioSampleRate() frames per second.
+    std::uint64_t      GetAudioClock() const { return audio.GetClock(); }
+    long               GetAudioSampleRate() const { return audio.GetSampleRate(); }
+
+    // Each channel is mixed into a bus (see SoundChannelHandle::SetBus()), which are then mixed
+    // into the Master bus. Each bus has its own gain and effects (e.g. LowPassFilter, Compressor,
+    // Limiter), and heavy buses can be mixed ahead of time on a worker thread.
+    void SetBusGain(AudioBus bus, double gain) { audio.SetBusGain(bus, gain); }
+    void AddBusEffect(AudioBus bus, const std::shared_ptr<AudioEffect>& effect)
+        { audio.AddBusEffect(bus, effect); }
+    void ClearBusEffects(AudioBus bus) { audio.ClearBusEffects(bus); }
+    void SetBusPrerender(AudioBus bus, bool prerender, std::uint32_t aheadFrames = 4096)
+        { audio.SetBusPrerender(bus, prerender, aheadFrames); }
     
     // Currently can only load .bmp files.
     ImageHandle CreateImage(const std::string& filename, bool smooth=false);
@@ -52,13 +81,24 @@ public:
     ImageHandle CreateImage(const ImageHandle& imageHandle,
                             const ImageHandle& alphaChannel,
                             bool smooth=false);
-    // This function is slow, consider prerendering where possible.
+    // Replaces the colors with their index in the palette. Palettes of more than
+    // Graphics::maxGpuPaletteColors colors are slow, consider prerendering where possible.
     ImageHandle CreateImage(const ImageHandle& imageHandle,
                             const ImageHandle& palette,
                             std::uint32_t paletteX, std::uint32_t paletteY,
                             std::uint32_t paletteW, std::uint32_t paletteH,
                             bool smooth=false);
+    // Sets a row of the palette store used by ImageHandle::DrawPalettedImage(), rows hold up to
+    // Graphics::paletteStoreWidth colors. Changing a row is cheap, so can be used to animate
+    // palettes.
+    void SetPaletteRow(std::uint32_t row, const std::vector<Color>& colors);
+    void SetPaletteRow(std::uint32_t row, const ImageHandle& palette,
+                       std::uint32_t paletteX, std::uint32_t paletteY, std::uint32_t paletteW);
     void DeleteImage(ImageHandle& imageHandle);
+    // Draws the commands recorded (e.g. by worker threads) in each buffer, in the order given.
+    void DrawCommands(const CommandBuffer* commandBuffers, size_t size);
+    void DrawCommands(const std::vector<CommandBuffer>& commandBuffers)
+        { DrawCommands(commandBuffers.data(), commandBuffers.size()); }
     void DisplayInWindow(const ImageHandle& imageHandle);
     void SaveImage(const ImageHandle& imageHandle, const std::string& filename);
 
@@ -86,14 +126,16 @@ public:
     void GetMouseState(std::int32_t& buttonsPressed, std::int32_t& x, std::int32_t& y)
         { EventHandler::GetMouseState(buttonsPressed, x, y); }
 
-    // Used to speed up drawing by manually providing hints to the graphics object.
+    // Used to speed up drawing by manually providing hints to the graphics object. The cache also
+    // predicts each frame's images from the last frame shown with DisplayInWindow().
     void UpdateImageCache(const ImageHandle* images, size_t size);
     void ClearImageCache();
 
 private:
     static std::string SdlGlAttrToString(SDL_GLattr attr);
 
-    void Init(const std::function<std::unique_ptr<Program>(MediaInterface&)>& programCreator);
+    void Init(const std::function<std::unique_ptr<Program>(MediaInterface&)>& programCreator,
+              const AudioSettings& audioSettings);
     void Free();
     void Run();
 